@@ -0,0 +1,443 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "aio.h"
+
+#define AIO_SLOT_COUNT		64
+#define AIO_THREAD_COUNT	4
+
+typedef struct {
+	bool busy;
+	bool write;
+	int fd;
+	off_t offset;
+	size_t len;
+	size_t done;    // bytes transferred so far
+	char *data;     // destination of a read, or copy for a write
+	char *copy;     // staging buffer owned by the slot
+} AioSlot;
+
+static AioBackend aioBackend = AIO_SYNC;
+static AioSlot slots[AIO_SLOT_COUNT];
+static int inFlight = 0;
+
+//io_uring state
+static int ringFD = -1;
+static void *sqRing = MAP_FAILED;
+static void *cqRing = MAP_FAILED;
+static size_t sqRingSize, cqRingSize, sqesSize;
+static unsigned *sqTail, *sqMask, *sqArray;
+static unsigned *cqHead, *cqTail, *cqMask;
+static struct io_uring_sqe *sqes = MAP_FAILED;
+static struct io_uring_cqe *cqes;
+static unsigned toSubmit = 0;  // queued requests the kernel has not seen yet
+
+//thread pool state
+static pthread_t workers[AIO_THREAD_COUNT];
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workDone = PTHREAD_COND_INITIALIZER;
+static int queue[AIO_SLOT_COUNT];
+static int queueHead = 0;
+static int queueCount = 0;
+static bool stopping = false;
+
+//Transfer the whole request, retrying short reads/writes. A read that hits
+//the end of the file stops there.
+static void transfer(AioSlot *slot)
+{
+	while(slot->done < slot->len)
+	{
+		ssize_t n = slot->write ?
+			pwrite(slot->fd, slot->data + slot->done, slot->len - slot->done, slot->offset + slot->done) :
+			pread(slot->fd, slot->data + slot->done, slot->len - slot->done, slot->offset + slot->done);
+
+		if(0 >= n)
+			break;
+		slot->done += n;
+	}
+}
+
+//Hand the queued requests to the kernel, waiting for minComplete completions
+//in the same call
+static void uringEnter(unsigned minComplete, unsigned flags)
+{
+	int submitted = syscall(__NR_io_uring_enter, ringFD, toSubmit, minComplete, flags, NULL, 0);
+
+	if(0 < submitted)
+		toSubmit -= submitted;
+}
+
+static void uringQueue(int idx)
+{
+	AioSlot *slot = &slots[idx];
+	unsigned tail = *sqTail;
+	unsigned sqIdx = tail & *sqMask;
+	struct io_uring_sqe *sqe = &sqes[sqIdx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = slot->write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = slot->fd;
+	sqe->addr = (uint64_t) (uintptr_t) (slot->data + slot->done);
+	sqe->len = slot->len - slot->done;
+	sqe->off = slot->offset + slot->done;
+	sqe->user_data = idx;
+
+	sqArray[sqIdx] = sqIdx;
+	__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+	toSubmit++;
+}
+
+//Collect completions, waiting for at least minComplete of them
+static void uringReap(unsigned minComplete)
+{
+	if(minComplete)
+		uringEnter(minComplete, IORING_ENTER_GETEVENTS);
+
+	unsigned head = *cqHead;
+	unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+	for(; head != tail; head++)
+	{
+		struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+		AioSlot *slot = &slots[cqe->user_data];
+
+		if(0 < cqe->res)
+			slot->done += cqe->res;
+
+		//finish a short or failed transfer synchronously rather than
+		//requeueing it
+		if(0 != cqe->res && slot->done < slot->len)
+			transfer(slot);
+
+		slot->busy = false;
+		inFlight--;
+	}
+
+	__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+static void uringClose(void)
+{
+	if(MAP_FAILED != sqes)
+		munmap(sqes, sqesSize);
+	if(MAP_FAILED != cqRing && cqRing != sqRing)
+		munmap(cqRing, cqRingSize);
+	if(MAP_FAILED != sqRing)
+		munmap(sqRing, sqRingSize);
+	if(-1 != ringFD)
+		close(ringFD);
+
+	sqes = MAP_FAILED;
+	sqRing = cqRing = MAP_FAILED;
+	ringFD = -1;
+	toSubmit = 0;
+}
+
+//Check that the kernel supports the opcodes used here. IORING_OP_READ and
+//IORING_OP_WRITE are younger than io_uring itself.
+static bool uringProbe(void)
+{
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	bool supported = false;
+
+	if(NULL != probe && 0 == syscall(__NR_io_uring_register, ringFD, IORING_REGISTER_PROBE, probe, 256))
+	{
+		supported = probe->last_op >= IORING_OP_READ && probe->last_op >= IORING_OP_WRITE &&
+				(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+				(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+	}
+
+	free(probe);
+	return supported;
+}
+
+static bool uringOpen(void)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	ringFD = syscall(__NR_io_uring_setup, AIO_SLOT_COUNT, &params);
+	if(0 > ringFD)
+	{
+		ringFD = -1;
+		return false;
+	}
+
+	if(!uringProbe())
+	{
+		uringClose();
+		return false;
+	}
+
+	sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	//newer kernels map both rings with a single mmap
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(cqRingSize > sqRingSize)
+			sqRingSize = cqRingSize;
+		cqRingSize = sqRingSize;
+	}
+
+	sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFD, IORING_OFF_SQ_RING);
+	if(MAP_FAILED == sqRing)
+	{
+		uringClose();
+		return false;
+	}
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+		cqRing = sqRing;
+	else
+		cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFD, IORING_OFF_CQ_RING);
+
+	sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFD, IORING_OFF_SQES);
+	if(MAP_FAILED == cqRing || MAP_FAILED == sqes)
+	{
+		uringClose();
+		return false;
+	}
+
+	sqTail = (unsigned *) ((char *) sqRing + params.sq_off.tail);
+	sqMask = (unsigned *) ((char *) sqRing + params.sq_off.ring_mask);
+	sqArray = (unsigned *) ((char *) sqRing + params.sq_off.array);
+	cqHead = (unsigned *) ((char *) cqRing + params.cq_off.head);
+	cqTail = (unsigned *) ((char *) cqRing + params.cq_off.tail);
+	cqMask = (unsigned *) ((char *) cqRing + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *) ((char *) cqRing + params.cq_off.cqes);
+
+	return true;
+}
+
+static void *worker(void *arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&poolLock);
+
+	while(true)
+	{
+		while(0 == queueCount && !stopping)
+			pthread_cond_wait(&workReady, &poolLock);
+
+		if(0 == queueCount && stopping)
+			break;
+
+		AioSlot *slot = &slots[queue[queueHead]];
+		queueHead = (queueHead + 1) % AIO_SLOT_COUNT;
+		queueCount--;
+
+		pthread_mutex_unlock(&poolLock);
+		transfer(slot);
+		pthread_mutex_lock(&poolLock);
+
+		slot->busy = false;
+		inFlight--;
+		pthread_cond_broadcast(&workDone);
+	}
+
+	pthread_mutex_unlock(&poolLock);
+	return NULL;
+}
+
+static bool poolOpen(void)
+{
+	stopping = false;
+	for(int i = 0; i < AIO_THREAD_COUNT; i++)
+	{
+		if(0 != pthread_create(&workers[i], NULL, worker, NULL))
+		{
+			//run with the threads that did start
+			if(0 == i)
+				return false;
+			break;
+		}
+	}
+	return true;
+}
+
+static void poolClose(void)
+{
+	pthread_mutex_lock(&poolLock);
+	stopping = true;
+	pthread_cond_broadcast(&workReady);
+	pthread_mutex_unlock(&poolLock);
+
+	for(int i = 0; i < AIO_THREAD_COUNT; i++)
+	{
+		if(workers[i])
+			pthread_join(workers[i], NULL);
+		workers[i] = 0;
+	}
+}
+
+//Wait for at least one request to finish. The pool lock is held by the
+//caller for the thread backend.
+static void waitOne(void)
+{
+	if(AIO_URING == aioBackend)
+		uringReap(1);
+	else
+		pthread_cond_wait(&workDone, &poolLock);
+}
+
+static bool conflicts(int fd, off_t offset, size_t len, bool write)
+{
+	for(int i = 0; i < AIO_SLOT_COUNT; i++)
+	{
+		AioSlot *slot = &slots[i];
+		if(!slot->busy || slot->fd != fd || (!write && !slot->write))
+			continue;
+		if(offset < slot->offset + (off_t) slot->len && slot->offset < offset + (off_t) len)
+			return true;
+	}
+	return false;
+}
+
+static void submit(int fd, char *data, size_t len, off_t offset, bool write)
+{
+	if(AIO_THREADS == aioBackend)
+		pthread_mutex_lock(&poolLock);
+
+	//keep overlapping requests in submission order
+	while(conflicts(fd, offset, len, write))
+		waitOne();
+
+	while(AIO_SLOT_COUNT == inFlight)
+		waitOne();
+
+	int idx = 0;
+	while(slots[idx].busy)
+		idx++;
+
+	AioSlot *slot = &slots[idx];
+	slot->busy = true;
+	slot->write = write;
+	slot->fd = fd;
+	slot->offset = offset;
+	slot->len = len;
+	slot->done = 0;
+	slot->data = data;
+
+	if(write)
+	{
+		memcpy(slot->copy, data, len);
+		slot->data = slot->copy;
+	}
+
+	inFlight++;
+
+	if(AIO_URING == aioBackend)
+	{
+		uringQueue(idx);
+	}
+	else
+	{
+		queue[(queueHead + queueCount) % AIO_SLOT_COUNT] = idx;
+		queueCount++;
+		pthread_cond_signal(&workReady);
+		pthread_mutex_unlock(&poolLock);
+	}
+}
+
+void aioRead(int fd, void *buf, size_t len, off_t offset)
+{
+	if(AIO_SYNC == aioBackend)
+	{
+		AioSlot slot = { .fd = fd, .offset = offset, .len = len, .data = buf };
+		transfer(&slot);
+		return;
+	}
+
+	submit(fd, buf, len, offset, false);
+}
+
+void aioWrite(int fd, const void *buf, size_t len, off_t offset)
+{
+	//too large for a slot: let everything in flight finish and write it here
+	if(AIO_SYNC != aioBackend && AIO_MAX_LEN < len)
+		aioDrain();
+
+	if(AIO_SYNC == aioBackend || AIO_MAX_LEN < len)
+	{
+		AioSlot slot = { .write = true, .fd = fd, .offset = offset, .len = len, .data = (char *) buf };
+		transfer(&slot);
+		return;
+	}
+
+	submit(fd, (char *) buf, len, offset, true);
+}
+
+void aioSubmit(void)
+{
+	if(AIO_URING == aioBackend && toSubmit)
+		uringEnter(0, 0);
+}
+
+void aioDrain(void)
+{
+	if(AIO_SYNC == aioBackend)
+		return;
+
+	if(AIO_THREADS == aioBackend)
+		pthread_mutex_lock(&poolLock);
+
+	while(0 < inFlight)
+		waitOne();
+
+	if(AIO_THREADS == aioBackend)
+		pthread_mutex_unlock(&poolLock);
+}
+
+AioBackend aioInit(AioBackend backend)
+{
+	aioBackend = AIO_SYNC;
+	if(AIO_SYNC == backend)
+		return aioBackend;
+
+	for(int i = 0; i < AIO_SLOT_COUNT; i++)
+	{
+		if(0 != posix_memalign((void **) &slots[i].copy, AIO_MAX_LEN, AIO_MAX_LEN))
+		{
+			aioShutdown();
+			return aioBackend;
+		}
+	}
+
+	if(AIO_URING == backend && uringOpen())
+		aioBackend = AIO_URING;
+	else if(poolOpen())
+		aioBackend = AIO_THREADS;
+
+	return aioBackend;
+}
+
+void aioShutdown(void)
+{
+	aioDrain();
+
+	if(AIO_URING == aioBackend)
+		uringClose();
+	else if(AIO_THREADS == aioBackend)
+		poolClose();
+
+	for(int i = 0; i < AIO_SLOT_COUNT; i++)
+	{
+		free(slots[i].copy);
+		slots[i].copy = NULL;
+	}
+
+	aioBackend = AIO_SYNC;
+}
@@ -0,0 +1,22 @@
+//Block I/O engine. Requests are queued and may still be in flight when the
+//call returns; aioSubmit starts the queued requests together and aioDrain
+//waits for all of them. Overlapping requests where one
+//of them is a write are never in flight at the same time, so the engine keeps
+//the same ordering as plain pread/pwrite.
+typedef enum {
+	AIO_SYNC,    // pread/pwrite on the calling thread
+	AIO_URING,   // io_uring, falls back to AIO_THREADS when unavailable
+	AIO_THREADS  // pool of worker threads doing pread/pwrite
+} AioBackend;
+
+#define AIO_MAX_LEN		4096 //largest single request
+
+AioBackend aioInit(AioBackend backend);
+void aioShutdown(void);
+
+//buf must stay valid until the next aioDrain
+void aioRead(int fd, void *buf, size_t len, off_t offset);
+//buf is copied, it can be reused as soon as the call returns
+void aioWrite(int fd, const void *buf, size_t len, off_t offset);
+void aioSubmit(void);
+void aioDrain(void);
@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "fs-sim.h"
+#include "crc32c.h"
+#include "lz.h"
+#include "blockmap.h"
+
+int readBlockMap(char *mapName, BlockMapEntry *map)
+{
+	char magic[8];
+	bool valid = false;
+
+	memset(map, 0, sizeof(BlockMapEntry) * (DATA_BLOCK_COUNT + 1));
+
+	FILE *mapFile = fopen(mapName, "rb");
+	if(NULL == mapFile)
+		return 0;
+
+	if(1 != fread(magic, sizeof(magic), 1, mapFile))
+		magic[0] = '\0';
+
+	if(0 == memcmp(magic, BLOCK_MAP_MAGIC, sizeof(magic)))
+		valid = 1 == fread(map, sizeof(BlockMapEntry) * (DATA_BLOCK_COUNT + 1), 1, mapFile);
+
+	//nothing may follow the entries
+	valid = valid && EOF == fgetc(mapFile);
+	fclose(mapFile);
+
+	//compressed blocks are shorter than a block, and blocks share only
+	//data blocks that hold their own contents
+	for(int i = 0; valid && i <= DATA_BLOCK_COUNT; i++)
+	{
+		valid = map[i].length < DATA_BLOCK_SIZE && map[i].target <= DATA_BLOCK_COUNT;
+		if(valid && map[i].target)
+			valid = 0 != i && map[i].target != i && 0 == map[map[i].target].target;
+	}
+	return valid ? 1 : -1;
+}
+
+bool decodeBlock(const BlockMapEntry *entry, const uint8_t *stored, uint8_t *out)
+{
+	return crc32c(0, stored, entry->length) == entry->crc &&
+			DATA_BLOCK_SIZE == lzDecompress(stored, entry->length, out, DATA_BLOCK_SIZE);
+}
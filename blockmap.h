@@ -0,0 +1,28 @@
+//How the data blocks of a disk are stored, kept next to the disk in
+//<disk>.map because there is no room for it in the superblock. The file
+//holds the magic followed by one BlockMapEntry per block, block 0 included.
+
+#define BLOCK_MAP_MAGIC		"FSBLKMP2"
+#define BLOCK_MAP_XATTR		"user.fs-sim.map" //set on a disk that has a map
+
+//A block with length 0 is stored as is, otherwise its first length bytes are
+//the compressed block and crc is their CRC32C. A block with a target has the
+//same contents as the target block and its own slot is not used; only blocks
+//holding their own contents have a target of 0 and only those can be
+//targets. hash is the CRC32C of the contents of a block that others may
+//share.
+typedef struct {
+	uint16_t length;
+	uint8_t target;
+	uint8_t hashed;
+	uint32_t crc;
+	uint32_t hash;
+} BlockMapEntry;
+
+//Read the map in mapName into map.
+//Returns 0 if there is no map, 1 if it was read and -1 if it is damaged.
+int readBlockMap(char *mapName, BlockMapEntry *map);
+
+//Decompress the stored bytes of a block with map entry entry into out.
+//Returns false if they do not match the entry.
+bool decodeBlock(const BlockMapEntry *entry, const uint8_t *stored, uint8_t *out);
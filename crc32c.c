@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "crc32c.h"
+
+#define CRC32C_POLY		0x82F63B78 //reflected Castagnoli polynomial
+
+static uint32_t crcTable[256];
+static bool crcTableReady = false;
+
+static void buildCrcTable(void)
+{
+	for(uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for(int j = 0; j < 8; j++)
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crcTable[i] = crc;
+	}
+	crcTableReady = true;
+}
+
+static uint32_t crc32cSoft(uint32_t crc, const uint8_t *data, size_t len)
+{
+	if(!crcTableReady)
+		buildCrcTable();
+
+	for(size_t i = 0; i < len; i++)
+		crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+//SSE4.2 has a dedicated crc32 instruction for the Castagnoli polynomial.
+//It is compiled for that target only and picked at runtime, so the binary
+//still runs on CPUs without it.
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHw(uint32_t crc, const uint8_t *data, size_t len)
+{
+	uint64_t crc64 = crc;
+
+	for(; len >= 8; len -= 8, data += 8)
+	{
+		uint64_t word;
+		__builtin_memcpy(&word, data, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+	}
+
+	crc = (uint32_t) crc64;
+	for(; len > 0; len--, data++)
+		crc = __builtin_ia32_crc32qi(crc, *data);
+
+	return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+	crc = ~crc;
+
+#if defined(__x86_64__)
+	if(__builtin_cpu_supports("sse4.2"))
+		return ~crc32cHw(crc, data, len);
+#endif
+
+	return ~crc32cSoft(crc, data, len);
+}
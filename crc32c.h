@@ -0,0 +1,2 @@
+//CRC32C (Castagnoli) checksum used to fingerprint superblocks
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
@@ -0,0 +1,563 @@
+//Format aware comparison of disk images. The superblocks are compared field
+//by field: the free block list bit by bit, then every inode by state, name,
+//size, start block, type and parent. Data blocks are only compared where
+//either image has them allocated, and every differing block is reported
+//with the file it belongs to and the range of bytes that differ. Blocks are
+//compared as fs reads them: an image with a <image>.map next to it has its
+//compressed blocks decoded and its shared blocks resolved first. A list of
+//image pairs can be verified by several threads at once.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/xattr.h>
+
+#include "fs-sim.h"
+#include "blockmap.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define IMAGE_SIZE		(DATA_BLOCK_SIZE * (DATA_BLOCK_COUNT + 1))
+#define NAME_LEN		256
+#define PATH_LEN		(INODE_COUNT * 6 + 1) //every inode on the path, "/" and 5 characters each
+
+typedef struct {
+	char *image;
+	char *expected;
+	char *report;   // differences found, written by the worker
+	int status;     // 0 same, 1 different, 2 error
+} DiffPair;
+
+//Count the bytes that differ between two blocks and find the first and last
+//of them
+typedef int (*BlockDiffFn)(const uint8_t *a, const uint8_t *b, int *first, int *last);
+
+static BlockDiffFn blockDiff = NULL;
+static bool quiet = false;
+static DiffPair *pairs = NULL;
+static int pairCount = 0;
+static int nextPair = 0;
+static pthread_mutex_t pairLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void outOfMemory(void)
+{
+	fprintf(stderr,"Error: Out of memory\n");
+	exit(2);
+}
+
+static int blockDiffScalar(const uint8_t *a, const uint8_t *b, int *first, int *last)
+{
+	int count = 0;
+
+	for(int i = 0; i < DATA_BLOCK_SIZE; i++)
+	{
+		if(a[i] == b[i])
+			continue;
+		if(0 == count++)
+			*first = i;
+		*last = i;
+	}
+	return count;
+}
+
+#if defined(__x86_64__)
+//SSE2 is part of x86-64, so this needs no runtime check
+static int blockDiffSse2(const uint8_t *a, const uint8_t *b, int *first, int *last)
+{
+	int count = 0;
+
+	for(int i = 0; i < DATA_BLOCK_SIZE; i += 16)
+	{
+		__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) (a + i)), _mm_loadu_si128((__m128i *) (b + i)));
+		uint32_t diff = (uint16_t) ~_mm_movemask_epi8(eq);
+
+		if(0 == diff)
+			continue;
+		if(0 == count)
+			*first = i + __builtin_ctz(diff);
+		*last = i + 31 - __builtin_clz(diff);
+		count += __builtin_popcount(diff);
+	}
+	return count;
+}
+
+__attribute__((target("avx2")))
+static int blockDiffAvx2(const uint8_t *a, const uint8_t *b, int *first, int *last)
+{
+	int count = 0;
+
+	for(int i = 0; i < DATA_BLOCK_SIZE; i += 32)
+	{
+		__m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *) (a + i)), _mm256_loadu_si256((__m256i *) (b + i)));
+		uint32_t diff = ~(uint32_t) _mm256_movemask_epi8(eq);
+
+		if(0 == diff)
+			continue;
+		if(0 == count)
+			*first = i + __builtin_ctz(diff);
+		*last = i + 31 - __builtin_clz(diff);
+		count += __builtin_popcount(diff);
+	}
+	return count;
+}
+#endif
+
+static void pickKernels(void)
+{
+	blockDiff = blockDiffScalar;
+
+#if defined(__x86_64__)
+	blockDiff = blockDiffSse2;
+
+	if(__builtin_cpu_supports("avx2"))
+		blockDiff = blockDiffAvx2;
+#endif
+}
+
+static bool blockUsed(Superblock *sb, int i)
+{
+	return sb->free_block_list[i/8] & (1 << (7 - (i%8)));
+}
+
+//Slash separated path of inode idx, built from the parent links. A parent
+//loop in a damaged image ends the walk.
+static void inodePath(Superblock *sb, int idx, char *path)
+{
+	int chain[INODE_COUNT];
+	int depth = 0;
+
+	while(ROOT_DIR != idx && idx < INODE_COUNT && depth < INODE_COUNT)
+	{
+		chain[depth++] = idx;
+		idx = sb->inode[idx].dir_parent & 0x7F;
+	}
+
+	path[0] = '\0';
+	for(int i = depth - 1; i >= 0; i--)
+	{
+		size_t len = strlen(path);
+		snprintf(path + len, PATH_LEN - len, "/%.5s", sb->inode[chain[i]].name);
+	}
+}
+
+//The file holding block in sb and the block number within it, or -1
+static int blockOwner(Superblock *sb, int block, int *fileBlock)
+{
+	for(int i = 0; i < INODE_COUNT; i++)
+	{
+		Inode *inode = &sb->inode[i];
+		int size = inode->used_size & 0x7F;
+
+		if(!(inode->used_size & 0x80) || (inode->dir_parent & 0x80))
+			continue;
+		if(block >= inode->start_block && block < inode->start_block + size)
+		{
+			*fileBlock = block - inode->start_block;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int compareInodes(FILE *out, Superblock *a, Superblock *b)
+{
+	int differences = 0;
+
+	for(int i = 0; i < INODE_COUNT; i++)
+	{
+		Inode *x = &a->inode[i];
+		Inode *y = &b->inode[i];
+		bool usedX = x->used_size & 0x80;
+		bool usedY = y->used_size & 0x80;
+		char path[PATH_LEN];
+
+		if(0 == memcmp(x, y, sizeof(Inode)))
+			continue;
+
+		if(!usedX && !usedY)
+		{
+			fprintf(out, "inode %d: free in both, contents differ\n", i);
+			differences++;
+			continue;
+		}
+
+		if(usedX != usedY)
+		{
+			inodePath(usedX ? a : b, i, path);
+			fprintf(out, "inode %d: %s / %s (%s)\n", i, usedX ? "used" : "free", usedY ? "used" : "free", path);
+			differences++;
+			continue;
+		}
+
+		inodePath(a, i, path);
+		if(0 != strncmp(x->name, y->name, 5))
+		{
+			fprintf(out, "inode %d: name %.5s / %.5s\n", i, x->name, y->name);
+			differences++;
+		}
+		if((x->dir_parent & 0x80) != (y->dir_parent & 0x80))
+		{
+			fprintf(out, "inode %d: type %s / %s (%s)\n", i,
+					(x->dir_parent & 0x80) ? "directory" : "file", (y->dir_parent & 0x80) ? "directory" : "file", path);
+			differences++;
+		}
+		if((x->dir_parent & 0x7F) != (y->dir_parent & 0x7F))
+		{
+			fprintf(out, "inode %d: parent %d / %d (%s)\n", i, x->dir_parent & 0x7F, y->dir_parent & 0x7F, path);
+			differences++;
+		}
+		if((x->used_size & 0x7F) != (y->used_size & 0x7F))
+		{
+			fprintf(out, "inode %d: size %d / %d (%s)\n", i, x->used_size & 0x7F, y->used_size & 0x7F, path);
+			differences++;
+		}
+		if(x->start_block != y->start_block)
+		{
+			fprintf(out, "inode %d: start %d / %d (%s)\n", i, x->start_block, y->start_block, path);
+			differences++;
+		}
+	}
+	return differences;
+}
+
+//Compare the blocks allocated in either image. Runs of such blocks are
+//checked with one memcmp first, only differing runs are looked at per block.
+static int compareBlocks(FILE *out, uint8_t *imageA, uint8_t *imageB)
+{
+	Superblock *a = (Superblock *) imageA;
+	Superblock *b = (Superblock *) imageB;
+	int differences = 0;
+
+	for(int i = 1; i <= DATA_BLOCK_COUNT; i++)
+	{
+		if(!blockUsed(a, i) && !blockUsed(b, i))
+			continue;
+
+		int runStart = i;
+		while(i <= DATA_BLOCK_COUNT && (blockUsed(a, i) || blockUsed(b, i)))
+			i++;
+
+		size_t offset = (size_t) runStart * DATA_BLOCK_SIZE;
+		if(0 == memcmp(imageA + offset, imageB + offset, (size_t) (i - runStart) * DATA_BLOCK_SIZE))
+			continue;
+
+		for(int block = runStart; block < i; block++)
+		{
+			int first = 0, last = 0;
+			offset = (size_t) block * DATA_BLOCK_SIZE;
+			int count = blockDiff(imageA + offset, imageB + offset, &first, &last);
+
+			if(0 == count)
+				continue;
+
+			char path[PATH_LEN];
+			int fileBlock = 0;
+			Superblock *owners = (-1 != blockOwner(a, block, &fileBlock)) ? a : b;
+			int owner = blockOwner(owners, block, &fileBlock);
+
+			fprintf(out, "block %d: %d bytes differ in %d-%d", block, count, first, last);
+			if(-1 != owner)
+			{
+				inodePath(owners, owner, path);
+				fprintf(out, " (%s block %d)", path, fileBlock);
+			}
+			fprintf(out, "\n");
+			differences++;
+		}
+	}
+	return differences;
+}
+
+//Read the image name into image, through stored, with the contents of its
+//data blocks as fs reads them. Returns the number of blocks that do not
+//match their map entry and are compared as stored, or -1.
+static int loadImage(char *name, uint8_t *image, uint8_t *stored, FILE *out)
+{
+	int fd = open(name, O_RDONLY);
+	ssize_t got = -1;
+
+	if(-1 != fd)
+	{
+		got = read(fd, stored, IMAGE_SIZE);
+		//a longer file is not an image either
+		if(IMAGE_SIZE == got && 0 != read(fd, stored, 1))
+			got = -1;
+		close(fd);
+	}
+
+	if(IMAGE_SIZE != got)
+	{
+		fprintf(out, "Error: %s is not a %d byte disk image\n", name, IMAGE_SIZE);
+		return -1;
+	}
+
+	BlockMapEntry map[DATA_BLOCK_COUNT + 1];
+	char mapName[NAME_LEN + 8];
+
+	snprintf(mapName, sizeof(mapName), "%s.map", name);
+	int mapState = readBlockMap(mapName, map);
+	if(-1 == mapState)
+	{
+		fprintf(out, "Error: Block map %s is damaged\n", mapName);
+		return -1;
+	}
+	if(0 == mapState && -1 != getxattr(name, BLOCK_MAP_XATTR, NULL, 0))
+	{
+		fprintf(out, "Error: Block map %s is missing\n", mapName);
+		return -1;
+	}
+
+	Superblock *sb = (Superblock *) stored;
+	int damaged = 0;
+
+	memcpy(image, stored, IMAGE_SIZE);
+	for(int block = 1; block <= DATA_BLOCK_COUNT; block++)
+	{
+		int contents = map[block].target ? map[block].target : block;
+		uint8_t *slot = stored + (size_t) contents * DATA_BLOCK_SIZE;
+		uint8_t *dst = image + (size_t) block * DATA_BLOCK_SIZE;
+
+		if(!blockUsed(sb, block) || (contents == block && !map[block].length))
+			continue;
+
+		if(!map[contents].length)
+			memcpy(dst, slot, DATA_BLOCK_SIZE);
+		else if(!decodeBlock(&map[contents], slot, dst))
+		{
+			fprintf(out, "%s: block %d does not match its map entry, compared as stored\n", name, block);
+			memcpy(dst, slot, DATA_BLOCK_SIZE);
+			damaged++;
+		}
+	}
+	return damaged;
+}
+
+//Compare the images of pair, using imageA and imageB to hold them and stored
+//to read them
+static void diffPair(DiffPair *pair, uint8_t *imageA, uint8_t *imageB, uint8_t *stored)
+{
+	size_t reportSize;
+	FILE *out = open_memstream(&pair->report, &reportSize);
+
+	if(NULL == out)
+		outOfMemory();
+	int damagedA = loadImage(pair->image, imageA, stored, out);
+	int damagedB = -1 == damagedA ? -1 : loadImage(pair->expected, imageB, stored, out);
+
+	if(-1 == damagedA || -1 == damagedB)
+	{
+		pair->status = 2;
+		fclose(out);
+		return;
+	}
+
+	Superblock *a = (Superblock *) imageA;
+	Superblock *b = (Superblock *) imageB;
+	int differences = damagedA + damagedB;
+
+	//runs of blocks that differ the same way are reported together
+	for(int i = 0; i <= DATA_BLOCK_COUNT; i++)
+	{
+		if(blockUsed(a, i) == blockUsed(b, i))
+			continue;
+
+		int runStart = i;
+		while(i + 1 <= DATA_BLOCK_COUNT && blockUsed(a, i + 1) != blockUsed(b, i + 1) && blockUsed(a, i + 1) == blockUsed(a, i))
+			i++;
+
+		if(runStart == i)
+			fprintf(out, "free list: block %d", i);
+		else
+			fprintf(out, "free list: blocks %d-%d", runStart, i);
+		fprintf(out, " %s / %s\n", blockUsed(a, i) ? "used" : "free", blockUsed(b, i) ? "used" : "free");
+		differences++;
+	}
+
+	differences += compareInodes(out, a, b);
+	differences += compareBlocks(out, imageA, imageB);
+
+	pair->status = differences ? 1 : 0;
+	fclose(out);
+}
+
+static void *diffWorker(void *arg)
+{
+	(void) arg;
+	uint8_t *images = malloc(3 * IMAGE_SIZE);
+
+	if(NULL == images)
+		outOfMemory();
+
+	while(true)
+	{
+		pthread_mutex_lock(&pairLock);
+		int idx = nextPair++;
+		pthread_mutex_unlock(&pairLock);
+
+		if(idx >= pairCount)
+			break;
+		diffPair(&pairs[idx], images, images + IMAGE_SIZE, images + 2 * IMAGE_SIZE);
+	}
+
+	free(images);
+	return NULL;
+}
+
+//Read "image expected" lines, blank lines are skipped. Returns the number of
+//pairs, or -1.
+static int readPairList(char *listName)
+{
+	FILE *list = fopen(listName, "r");
+	char line[2 * NAME_LEN + 2];
+	int capacity = 0;
+	int lineNum = 0;
+
+	if(NULL == list)
+	{
+		fprintf(stderr,"Error: Cannot open %s\n", listName);
+		return -1;
+	}
+
+	while(NULL != fgets(line, sizeof(line), list))
+	{
+		lineNum++;
+
+		//a line that does not fit is too long for two names
+		bool whole = NULL != strchr(line, '\n') || feof(list);
+		char *image = strtok(line, " \t\r\n");
+		char *expected = strtok(NULL, " \t\r\n");
+
+		if(NULL == image)
+			continue;
+
+		if(!whole || NULL == expected || NULL != strtok(NULL, " \t\r\n") ||
+				NAME_LEN <= strlen(image) || NAME_LEN <= strlen(expected))
+		{
+			fprintf(stderr,"Error: %s, line %d is not an image pair\n", listName, lineNum);
+			fclose(list);
+			return -1;
+		}
+
+		if(pairCount == capacity)
+		{
+			capacity = capacity ? 2 * capacity : 64;
+			DiffPair *grown = realloc(pairs, capacity * sizeof(DiffPair));
+			if(NULL == grown)
+				outOfMemory();
+			pairs = grown;
+		}
+		pairs[pairCount].image = strdup(image);
+		pairs[pairCount].expected = strdup(expected);
+		if(NULL == pairs[pairCount].image || NULL == pairs[pairCount].expected)
+			outOfMemory();
+		pairs[pairCount].report = NULL;
+		pairCount++;
+	}
+
+	fclose(list);
+	return pairCount;
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,"Usage: %s [-q] image expected\n"
+			"       %s [-q] [-j threads] -l pair_list\n", prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+	char *listName = NULL;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+
+	while(-1 != (opt = getopt(argc, argv, "qj:l:")))
+	{
+		switch(opt)
+		{
+			case 'q':
+				quiet = true;
+				break;
+			case 'j':
+				threads = atol(optarg);
+				break;
+			case 'l':
+				listName = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+
+	if((NULL == listName && 2 != argc - optind) || (NULL != listName && optind != argc) || threads < 1)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	if(NULL == listName)
+	{
+		static uint8_t imageA[IMAGE_SIZE], imageB[IMAGE_SIZE], stored[IMAGE_SIZE];
+		DiffPair pair = {argv[optind], argv[optind + 1], NULL, 0};
+
+		pickKernels();
+		diffPair(&pair, imageA, imageB, stored);
+		if(2 == pair.status)
+			fputs(pair.report, stderr);
+		else if(!quiet)
+			fputs(pair.report, stdout);
+		free(pair.report);
+		return pair.status;
+	}
+
+	if(-1 == readPairList(listName))
+		return 2;
+
+	pickKernels();
+
+	if(threads > pairCount)
+		threads = pairCount ? pairCount : 1;
+
+	pthread_t *workers = malloc(threads * sizeof(pthread_t));
+	long started = 0;
+
+	if(NULL == workers)
+		outOfMemory();
+	while(started < threads && 0 == pthread_create(&workers[started], NULL, diffWorker, NULL))
+		started++;
+	//without a single thread the pairs are compared here
+	if(0 == started)
+		diffWorker(NULL);
+	for(long i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	//reports come out in list order, whatever order they were made in
+	int status = 0;
+	for(int i = 0; i < pairCount; i++)
+	{
+		DiffPair *pair = &pairs[i];
+
+		if(pair->status > status)
+			status = pair->status;
+
+		if(2 == pair->status)
+			fprintf(stderr, "%s", pair->report);
+		else if(1 == pair->status)
+		{
+			fprintf(stdout, "%s %s: differ\n", pair->image, pair->expected);
+			if(!quiet)
+				fputs(pair->report, stdout);
+		}
+		else if(!quiet)
+			fprintf(stdout, "%s %s: same\n", pair->image, pair->expected);
+	}
+	return status;
+}
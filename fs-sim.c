@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -5,74 +6,689 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <linux/falloc.h>
 
 #include "fs-sim.h"
-
-#define FREE_SPACE_SIZE		16 //bytes
-#define INODE_COUNT			126
-#define INODE_LIST_SIZE		sizeof(Inode) * INODE_COUNT
-#define ROOT_DIR			127
-#define DATA_BLOCK_COUNT	127
-#define DATA_BLOCK_SIZE		1024
+#include "crc32c.h"
+#include "aio.h"
+#include "inode-table.h"
+#include "trace.h"
+#include "server.h"
+#include "lz.h"
+#include "blockmap.h"
+
+#define DISK_STATE_COUNT	8
+#define DIRECT_IO_ALIGN		4096 //alignment of every buffer handed to the disk
+#define PATH_MAX_LEN		256
+#define COMPACT_IDLE_MS		20 //command stream idle time before compacting
+#define RA_MIN_WINDOW		2  //blocks read ahead once a file is read sequentially
+#define RA_MAX_WINDOW		16 //largest readahead window, in blocks
+
+//Per-process record of disks this process has validated or written. A disk
+//whose superblock still matches the checksum taken at its last clean write
+//does not need to go through the full consistency check again on remount.
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	uint32_t checksum; // CRC32C of the superblock as last written/validated
+	bool clean;        // false while an operation has the superblock half updated
+} DiskState;
+
+//Sequential read detection for one file. window is the number of blocks the
+//next readahead fetches; it doubles every time a sequential reader runs into
+//the end of the readahead window and drops to 0 when the reader seeks.
+typedef struct {
+	int next;    // block number a sequential reader asks for next
+	int window;
+} ReadStream;
 
 int diskFD = -1;
 int mountedDiskFD = -1;
 Superblock *temp_superBlock = NULL;
 Superblock *superBlock = NULL;
 uint8_t cwd = 0;
-char diskName[10];
-char buffer[1024] = {'\0'};
+char diskName[PATH_MAX_LEN];
+char buffer[1024] __attribute__((aligned(DIRECT_IO_ALIGN))) = {'\0'};
+const char zeroData[DATA_BLOCK_SIZE] __attribute__((aligned(DIRECT_IO_ALIGN))) = {'\0'};
+DiskState diskStates[DISK_STATE_COUNT];
+int diskStateCount = 0;
+DiskState *mountedDiskState = NULL;
+bool lazyZero = false;
+char zeroBlockList[FREE_SPACE_SIZE];
+char pendingZeroList[FREE_SPACE_SIZE];
+bool bufferInFlight = false;
+bool directIO = false;
+InodeTable inodeTable;
+int relocatedFiles = 0;   // files fs_resize had to move to grow them
+int fragmentedFails = 0;  // allocations that failed with enough blocks free
+
+//Background compactor. Commands and compaction steps take turns on fsLock:
+//every command is followed by the compactor's turn, and a command that is
+//waiting for fsLock stops the compactor after its current step, so a command
+//never waits for more than one file move.
+bool compactorEnabled = false;
+bool compactorStop = false;
+int compactThreshold = 100;  // fragmented share of free space, in percent
+int compactedFiles = 0;
+struct timespec lastCommand;
+pthread_t compactorThread;
+pthread_mutex_t fsLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t compactorWake;
+pthread_cond_t commandTurn = PTHREAD_COND_INITIALIZER;
+atomic_int commandWaiting = 0;  // commands waiting for fsLock
+bool compactorTurn = false;     // the compactor goes before the next command
+
+//Compressed block storage
+bool compressBlocks = false;
+bool blockMapUsed = false;  // the map was loaded from disk or has compressed blocks
+bool blockMapOnFile = false;  // <disk>.map exists and holds savedMap
+BlockMapEntry blockMap[DATA_BLOCK_COUNT + 1];
+BlockMapEntry savedMap[DATA_BLOCK_COUNT + 1];  // the map as last written
+char blockMapName[PATH_MAX_LEN + 8];
+uint64_t logicalBytes = 0;  // bytes handed to fs_write while compressing
+uint64_t storedBytes = 0;   // bytes those writes stored
+uint64_t compressNs = 0;
+uint64_t decompressNs = 0;
+
+//Block deduplication
+bool dedupBlocks = false;
+uint8_t blockRefs[DATA_BLOCK_COUNT + 1];  // blocks sharing the contents of each block
+int dedupWrites = 0;    // writes that found their contents already stored
+int copyOnWrites = 0;   // shared contents copied because their block changed
+
+//Readahead. raBuffer holds the raw slots of blocks raStart to raStart + raCount - 1,
+//which may still be in flight until the next aioDrain.
+ReadStream readStreams[INODE_COUNT];
+char raBuffer[RA_MAX_WINDOW][DATA_BLOCK_SIZE] __attribute__((aligned(DIRECT_IO_ALIGN)));
+int raStart = 0;
+int raCount = 0;
+bool raInFlight = false;
+int raHits = 0;     // sequential reads served from the readahead window
+int raMisses = 0;   // sequential reads that had to go to the disk
+int raBlocks = 0;   // blocks read ahead
+
+DiskState *findDiskState(struct stat *st)
+{
+	for(int i = 0; i < diskStateCount; i++)
+	{
+		if(diskStates[i].dev == st->st_dev && diskStates[i].ino == st->st_ino)
+			return &diskStates[i];
+	}
+
+	//Recycle the oldest slot once the table is full
+	if(DISK_STATE_COUNT == diskStateCount)
+	{
+		memmove(&diskStates[0], &diskStates[1], sizeof(DiskState) * (DISK_STATE_COUNT - 1));
+		diskStateCount--;
+		if(mountedDiskState)
+			mountedDiskState = (mountedDiskState == &diskStates[0]) ? NULL : mountedDiskState - 1;
+	}
+
+	DiskState *state = &diskStates[diskStateCount++];
+	state->dev = st->st_dev;
+	state->ino = st->st_ino;
+	state->checksum = 0;
+	state->clean = false;
+	return state;
+}
+
+//Called before the in-memory superblock is modified. The disk stays dirty
+//until writeSuperBlock has put the new superblock on disk.
+void markDirty()
+{
+	if(mountedDiskState)
+		mountedDiskState->clean = false;
+}
+
+bool blockMapNeeded()
+{
+	bool needed = false;
+	for(int i = 0; i <= DATA_BLOCK_COUNT; i++)
+		needed |= (0 != blockMap[i].length || 0 != blockMap[i].target || 0 != blockMap[i].hashed);
+	return needed;
+}
+
+//Write the map next to the disk if it changed. It goes out before the
+//superblock or data block that depends on it, so a process that dies between
+//two writes never leaves a disk whose blocks its map does not describe. The
+//map is replaced through a temporary file and the disk is marked as having
+//one, so that a missing map is found on mount.
+void writeBlockMap()
+{
+	if(!blockMapUsed || (blockMapOnFile && 0 == memcmp(blockMap, savedMap, sizeof(blockMap))) || !blockMapNeeded())
+		return;
+
+	char tempName[sizeof(blockMapName) + 4];
+	snprintf(tempName, sizeof(tempName), "%s.tmp", blockMapName);
+
+	FILE *mapFile = fopen(tempName, "wb");
+	bool written = NULL != mapFile && 1 == fwrite(BLOCK_MAP_MAGIC, 8, 1, mapFile) &&
+			1 == fwrite(blockMap, sizeof(blockMap), 1, mapFile);
+
+	if(NULL != mapFile && 0 != fclose(mapFile))
+		written = false;
+
+	if(!written || 0 != rename(tempName, blockMapName))
+	{
+		fprintf(stderr,"Error: Cannot write the block map %s\n", blockMapName);
+		unlink(tempName);
+		return;
+	}
+
+	if(!blockMapOnFile)
+		fsetxattr(mountedDiskFD, BLOCK_MAP_XATTR, "1", 1, 0);
+	memcpy(savedMap, blockMap, sizeof(blockMap));
+	blockMapOnFile = true;
+}
+
+//Remove the map once no block is compressed, shared or open to sharing. This
+//follows the superblock write that stops referring to it.
+void dropBlockMap()
+{
+	if(!blockMapOnFile || blockMapNeeded())
+		return;
+
+	unlink(blockMapName);
+	fremovexattr(mountedDiskFD, BLOCK_MAP_XATTR);
+	blockMapOnFile = false;
+}
 
 void writeSuperBlock()
 {
-	lseek(mountedDiskFD, 0, SEEK_SET);
+	//wite the free_block_list and inode list to the memory. They are laid out
+	//back to back in Superblock, so a single aligned write covers both.
+	writeBlockMap();
+	pwrite(mountedDiskFD, superBlock, sizeof(Superblock), 0);
+	dropBlockMap();
 
-	//wite the free_block_list and inode list to the memory
-	write(mountedDiskFD, superBlock->free_block_list, FREE_SPACE_SIZE);
-	write(mountedDiskFD, superBlock->inode, sizeof(Inode) * INODE_COUNT);
+	if(mountedDiskState)
+	{
+		mountedDiskState->checksum = crc32c(0, superBlock, sizeof(Superblock));
+		mountedDiskState->clean = true;
+	}
 }
 
-void fs_resize(char name[5], int new_size)
+int countFreeBlocks()
 {
-	
-	int inodeIdx = -1;
+	int freeBlocks = 0;
+	for(int i = 1; i <= DATA_BLOCK_COUNT; i++)
+	{
+		if(!(superBlock->free_block_list[i/8] & (1 << (7 - (i%8)))))
+			freeBlocks++;
+	}
+	return freeBlocks;
+}
 
-	for(int i = 0; i < INODE_COUNT; i++)
+bool blockBit(char *list, int i)
+{
+	return list[i/8] & (1 << (7 - (i%8)));
+}
+
+void setBlockBit(char *list, int i, bool value)
+{
+	if(value)
+		list[i/8] |= (1 << (7 - (i%8)));
+	else
+		list[i/8] &= ~(1 << (7 - (i%8)));
+}
+
+//Every data block write goes through here, so the readahead window never
+//holds contents older than the disk. A write of the whole slot also leaves
+//nothing for lazy zeroing to clear.
+void writeDataBlock(const void *buf, size_t len, int block)
+{
+	if(block >= raStart && block < raStart + raCount)
+		raCount = block - raStart;
+
+	if(lazyZero && DATA_BLOCK_SIZE == len)
+	{
+		setBlockBit(zeroBlockList, block, false);
+		setBlockBit(pendingZeroList, block, false);
+	}
+
+	writeBlockMap();
+	aioWrite(mountedDiskFD, buf, len, (off_t) block * DATA_BLOCK_SIZE);
+}
+
+//Block whose slot holds the contents of block
+int contentBlock(int block)
+{
+	return blockMap[block].target ? blockMap[block].target : block;
+}
+
+void countBlockRefs()
+{
+	memset(blockRefs, 0, sizeof(blockRefs));
+	for(int i = 1; i <= DATA_BLOCK_COUNT; i++)
+	{
+		if(blockMap[i].target)
+			blockRefs[blockMap[i].target]++;
+	}
+}
+
+//The contents of block are about to be overwritten or freed. Blocks still
+//sharing them get a copy: the first one takes over the slot contents and map
+//entry, the others share from it.
+void unshareBlock(int block)
+{
+	static char slot[DATA_BLOCK_SIZE] __attribute__((aligned(DIRECT_IO_ALIGN)));
+
+	if(blockMap[block].target)
+	{
+		blockRefs[blockMap[block].target]--;
+		blockMap[block].target = 0;
+		return;
+	}
+
+	int heir = 0;
+	for(int i = 1; i <= DATA_BLOCK_COUNT && blockRefs[block]; i++)
 	{
-		if((superBlock->inode[i].used_size & 0x80) && (0 == strncmp(name, superBlock->inode[i].name,5) && 
-					(cwd == (superBlock->inode[i].dir_parent & 0x7F))))
+		if(blockMap[i].target != block)
+			continue;
+
+		if(0 == heir)
+		{
+			heir = i;
+			aioRead(mountedDiskFD, slot, DATA_BLOCK_SIZE, (off_t) block * DATA_BLOCK_SIZE);
+			aioDrain();
+			writeDataBlock(slot, DATA_BLOCK_SIZE, heir);
+			blockMap[heir] = blockMap[block];
+			copyOnWrites++;
+		}
+		else
 		{
-			inodeIdx = i;
-			break;
+			blockMap[i].target = heir;
+			blockRefs[heir]++;
 		}
+		blockRefs[block]--;
+	}
+
+	blockMap[block].hashed = 0;
+}
+
+//Lazy zeroing: a freed data block is only recorded in pendingZeroList and
+//zeroed on disk when the disk is unmounted. zeroBlockList holds every block
+//whose contents are known to be zeros, so reading one needs no disk access.
+void zeroDataBlock(int block)
+{
+	unshareBlock(block);
+	blockMap[block].length = 0;
+
+	if(lazyZero)
+	{
+		setBlockBit(zeroBlockList, block, true);
+		setBlockBit(pendingZeroList, block, true);
+		return;
 	}
 
+	writeDataBlock(zeroData, DATA_BLOCK_SIZE, block);
+}
+
+//Move count data blocks starting at src to dst and empty out the source
+//blocks that are not overwritten. The whole extent is read before anything is
+//written, so the two ranges may overlap.
+void moveExtent(int dst, int src, int count)
+{
+	static char staging[DATA_BLOCK_COUNT + 1][DATA_BLOCK_SIZE] __attribute__((aligned(DIRECT_IO_ALIGN)));
+	bool srcZero[DATA_BLOCK_COUNT + 1] = {false};
+	BlockMapEntry srcMap[DATA_BLOCK_COUNT + 1];
+
+	for(int k = 0; k < count; k++)
+	{
+		srcMap[k] = blockMap[src + k];
+		srcZero[k] = lazyZero && blockBit(zeroBlockList, src + k);
+		//a shared block has nothing of its own in its slot
+		if(!srcZero[k] && !srcMap[k].target)
+			aioRead(mountedDiskFD, staging[k], DATA_BLOCK_SIZE, (off_t) (src + k) * DATA_BLOCK_SIZE);
+	}
+	aioDrain();
+
+	for(int k = 0; k < count; k++)
+	{
+		//compressed blocks are copied whole, so they keep their map entry
+		blockMap[dst + k] = srcMap[k];
+
+		if(srcZero[k])
+		{
+			//nothing to copy, the destination only has to read as zeros
+			blockMap[dst + k].length = 0;
+			setBlockBit(zeroBlockList, dst + k, true);
+			setBlockBit(pendingZeroList, dst + k, true);
+			continue;
+		}
+
+		//a shared block reads its target, but its own slot keeps whatever
+		//was freed there until the pending zeros are flushed
+		if(!srcMap[k].target)
+			writeDataBlock(staging[k], DATA_BLOCK_SIZE, dst + k);
+		else if(lazyZero)
+			setBlockBit(zeroBlockList, dst + k, false);
+	}
+
+	//the source blocks left behind hold nothing anymore, and blocks sharing
+	//the contents of the extent follow it
+	for(int k = 0; k < count; k++)
+	{
+		if(src + k < dst || src + k >= dst + count)
+			memset(&blockMap[src + k], 0, sizeof(BlockMapEntry));
+	}
+	for(int i = 1; i <= DATA_BLOCK_COUNT; i++)
+	{
+		if(blockMap[i].target >= src && blockMap[i].target < src + count)
+			blockMap[i].target += dst - src;
+	}
+	countBlockRefs();
+
+	for(int k = 0; k < count; k++)
+	{
+		if(src + k < dst || src + k >= dst + count)
+			zeroDataBlock(src + k);
+	}
+}
+
+//fs_read fills buffer asynchronously, anything else that uses buffer has to
+//wait for that read to land first
+void settleBuffer()
+{
+	if(bufferInFlight)
+	{
+		aioDrain();
+		bufferInFlight = false;
+	}
+}
+
+//Start reading count blocks from start into the readahead window, in
+//requests of up to AIO_MAX_LEN bytes. They land by the next aioDrain.
+void readAhead(int start, int count)
+{
+	if(count > RA_MAX_WINDOW)
+		count = RA_MAX_WINDOW;
+
+	//the previous window may still be landing in the same buffer
+	if(raInFlight)
+		aioDrain();
+
+	raStart = start;
+	raCount = count;
+	raBlocks += count;
+
+	for(int k = 0; k < count; k += AIO_MAX_LEN / DATA_BLOCK_SIZE)
+	{
+		int blocks = count - k < AIO_MAX_LEN / DATA_BLOCK_SIZE ? count - k : AIO_MAX_LEN / DATA_BLOCK_SIZE;
+		aioRead(mountedDiskFD, raBuffer[k], (size_t) blocks * DATA_BLOCK_SIZE, (off_t) (start + k) * DATA_BLOCK_SIZE);
+	}
+	aioSubmit();
+	raInFlight = true;
+}
+
+//Copy block from the readahead window into out. Returns false if the window
+//does not hold it.
+bool readAheadHit(int block, char *out)
+{
+	if(block < raStart || block >= raStart + raCount)
+		return false;
+
+	if(raInFlight)
+	{
+		aioDrain();
+		raInFlight = false;
+	}
+	memcpy(out, raBuffer[block - raStart], DATA_BLOCK_SIZE);
+	return true;
+}
+
+void resetReadAhead()
+{
+	memset(readStreams, 0, sizeof(readStreams));
+	raCount = 0;
+}
+
+//Zero every block freed under lazy zeroing. Runs of blocks are released with
+//a single hole punch; if the file system cannot punch holes the zeros are
+//written out instead.
+void flushPendingZeros()
+{
+	for(int i = 0; i <= DATA_BLOCK_COUNT; i++)
+	{
+		if(!blockBit(pendingZeroList, i))
+			continue;
+
+		int runStart = i;
+		while(i <= DATA_BLOCK_COUNT && blockBit(pendingZeroList, i))
+			setBlockBit(pendingZeroList, i++, false);
+
+		if(0 == fallocate(mountedDiskFD, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					(off_t) runStart * DATA_BLOCK_SIZE, (off_t) (i - runStart) * DATA_BLOCK_SIZE))
+			continue;
+
+		for(int j = runStart; j < i; j++)
+			pwrite(mountedDiskFD, zeroData, DATA_BLOCK_SIZE, (off_t) j * DATA_BLOCK_SIZE);
+	}
+}
+
+uint64_t nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//Store buffer in block compressed, or as is if it does not get smaller
+void writeCompressed(int block)
+{
+	static uint8_t packed[DATA_BLOCK_SIZE] __attribute__((aligned(DIRECT_IO_ALIGN)));
+
+	uint64_t start = nowNs();
+	int length = lzCompress((uint8_t *) buffer, DATA_BLOCK_SIZE, packed, DATA_BLOCK_SIZE - 1);
+	compressNs += nowNs() - start;
+	logicalBytes += DATA_BLOCK_SIZE;
+
+	if(-1 == length)
+	{
+		blockMap[block].length = 0;
+		storedBytes += DATA_BLOCK_SIZE;
+		writeDataBlock(buffer, DATA_BLOCK_SIZE, block);
+		return;
+	}
+
+	blockMap[block].length = length;
+	blockMap[block].crc = crc32c(0, packed, length);
+	blockMapUsed = true;
+	storedBytes += length;
+
+	//O_DIRECT transfers whole aligned blocks, and a slot still holding freed
+	//contents has them cleared past the compressed bytes. Elsewhere only the
+	//compressed bytes are written.
+	if(directIO || (lazyZero && blockBit(pendingZeroList, block)))
+	{
+		memset(packed + length, 0, DATA_BLOCK_SIZE - length);
+		length = DATA_BLOCK_SIZE;
+	}
+	writeDataBlock(packed, length, block);
+}
+
+//Decompress block into out. Returns false if the block does not match its
+//map entry, it is then to be read as stored.
+bool readCompressed(int block, char *out)
+{
+	static uint8_t packed[DATA_BLOCK_SIZE] __attribute__((aligned(DIRECT_IO_ALIGN)));
+	int length = blockMap[block].length;
+
+	aioRead(mountedDiskFD, packed, directIO ? DATA_BLOCK_SIZE : length, (off_t) block * DATA_BLOCK_SIZE);
+	aioDrain();
+
+	uint64_t start = nowNs();
+	bool decoded = decodeBlock(&blockMap[block], packed, (uint8_t *) out);
+	decompressNs += nowNs() - start;
+
+	if(decoded)
+		return true;
+
+	blockMap[block].length = 0;
+	memset(out, '\0', DATA_BLOCK_SIZE);
+	return false;
+}
+
+//Read the contents of block, as fs_read would return them, into out
+void readContents(int block, char *out)
+{
+	int contents = contentBlock(block);
+
+	if(lazyZero && blockBit(zeroBlockList, block))
+		memset(out, '\0', DATA_BLOCK_SIZE);
+	else if(!blockMap[contents].length || !readCompressed(contents, out))
+	{
+		aioRead(mountedDiskFD, out, DATA_BLOCK_SIZE, (off_t) contents * DATA_BLOCK_SIZE);
+		aioDrain();
+	}
+}
+
+//Make block share a block already holding the contents of buffer. Candidates
+//are found by hash and compared in full before anything is shared.
+bool shareBlock(int block, uint32_t hash)
+{
+	static char stored[DATA_BLOCK_SIZE] __attribute__((aligned(DIRECT_IO_ALIGN)));
+
+	for(int i = 1; i <= DATA_BLOCK_COUNT; i++)
+	{
+		if(i == block || !blockMap[i].hashed || blockMap[i].hash != hash)
+			continue;
+
+		readContents(i, stored);
+		if(0 != memcmp(stored, buffer, DATA_BLOCK_SIZE))
+			continue;
+
+		blockMap[block].target = i;
+		blockMap[block].length = 0;
+		blockRefs[i]++;
+		blockMapUsed = true;
+		dedupWrites++;
+		return true;
+	}
+	return false;
+}
+
+void unmountDisk()
+{
+	if(-1 == mountedDiskFD)
+		return;
+
+	settleBuffer();
+	aioDrain();
+	raInFlight = false;
+	resetReadAhead();
+
+	if(lazyZero)
+		flushPendingZeros();
+
+	writeBlockMap();
+	dropBlockMap();
+	close(mountedDiskFD);
+	mountedDiskFD = -1;
+	mountedDiskState = NULL;
+}
+
+//Walk the directories of a slash separated path, starting at base or at the
+//root for an absolute path. On success dir is the directory holding the last
+//component and leaf is that component. "/" and paths ending in "/" leave
+//leaf empty.
+bool resolvePath(char *path, uint8_t base, uint8_t *dir, char leaf[6])
+{
+	uint8_t curr = base;
+	char component[6];
+
+	if('/' == path[0])
+	{
+		curr = ROOT_DIR;
+		path++;
+	}
+
+	while(true)
+	{
+		int len = 0;
+		while(path[len] != '\0' && path[len] != '/' && len < 5)
+			len++;
+
+		memset(component, '\0', sizeof(component));
+		memcpy(component, path, len);
+
+		if('/' != path[len])
+		{
+			*dir = curr;
+			memcpy(leaf, component, sizeof(component));
+			return true;
+		}
+
+		path += len + 1;
+
+		if(0 == strcmp(component, ".."))
+		{
+			if(ROOT_DIR != curr)
+				curr = superBlock->inode[curr].dir_parent & 0x7F;
+			continue;
+		}
+
+		if(0 == strcmp(component, ".") || 0 == len)
+			continue;
+
+		int inodeIdx = inodeTableLookup(&inodeTable, component, curr);
+
+		if((-1 == inodeIdx) || !(superBlock->inode[inodeIdx].dir_parent & 0x80))
+		{
+			fprintf(stderr,"Error: Directory %s does not exist\n", component);
+			return false;
+		}
+
+		curr = inodeIdx;
+	}
+}
+
+void fs_resize(char name[5], int new_size)
+{
+	uint8_t dir;
+	char leaf[6];
+
+	if(!resolvePath(name, cwd, &dir, leaf))
+		return;
+
+	int inodeIdx = inodeTableLookup(&inodeTable, leaf, dir);
+
 	if(-1 == inodeIdx)
+	{
 		fprintf(stderr,"File %s does not exist\n",name);
+		return;
+	}
+
+	markDirty();
 
 	int startBlock = superBlock->inode[inodeIdx].start_block;
     int oldSize = superBlock->inode[inodeIdx].used_size & 0x7F;
 
-    lseek(mountedDiskFD, 0, SEEK_SET);
-
 	if(new_size < oldSize)
 	{
 		for(int i = startBlock + new_size; i< startBlock + oldSize; i++)
 		{
-			void *filePtr = mmap(NULL, 128 * DATA_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, mountedDiskFD, 0);
-
-            memset(filePtr + (i * DATA_BLOCK_SIZE), 0, DATA_BLOCK_SIZE);
+            zeroDataBlock(i);
             superBlock->free_block_list [i/8] &= ~(1 << (7 - (i%8)));
 		}
 
 		superBlock->inode[inodeIdx].used_size = 0x80 | new_size;
+		traceEvent(TRACE_FREE, TRACE_RESIZE, inodeIdx, startBlock + new_size, 0, oldSize - new_size, countFreeBlocks());
 	}
 	else
 	{
-		bool contiguousBlocks = true;
-		//check if contiguous data blocks are available from the current last data block
-		for(int i = startBlock + oldSize; i < startBlock + new_size; i++)
+		//check if contiguous data blocks are available from the current last data
+		//block, without running past the last data block
+		bool contiguousBlocks = startBlock + new_size - 1 <= DATA_BLOCK_COUNT;
+		for(int i = startBlock + oldSize; contiguousBlocks && i < startBlock + new_size; i++)
 		{
 			if(superBlock->free_block_list[i/8] & (1 << (7 - (i%8))))
 				contiguousBlocks = false;
@@ -87,6 +703,9 @@ void fs_resize(char name[5], int new_size)
 			}
 			superBlock->inode[inodeIdx].used_size = 0x80 | new_size;
 
+			if(new_size > oldSize)
+				traceEvent(TRACE_ALLOC, TRACE_RESIZE, inodeIdx, startBlock + oldSize, 0, new_size - oldSize, countFreeBlocks());
+
 		}
 		else
 		{
@@ -106,17 +725,17 @@ void fs_resize(char name[5], int new_size)
 
 				for(int j = i+1; j < DATA_BLOCK_COUNT; j++)
 				{
-					if(new_size == j-i+1)
-					{	
-						newStartBlock = i;
-						break;
-					}
-
 					if(superBlock->free_block_list[j/8] & (1 << (7 - (j%8))))
 					{
 						i = j;
 						break;
 					}
+
+					if(new_size == j-i+1)
+					{	
+						newStartBlock = i;
+						break;
+					}
 				}
 			}
 
@@ -124,18 +743,18 @@ void fs_resize(char name[5], int new_size)
 			{
 				//this means there aren't enough contiguous free blocks
 				fprintf(stderr,"Error: File %s cannot expand to size %d\n",name, new_size);
+
+				if(countFreeBlocks() >= new_size - oldSize)
+					fragmentedFails++;
+				traceEvent(TRACE_ALLOC_FAIL, TRACE_RESIZE, inodeIdx, 0, 0, new_size - oldSize, countFreeBlocks());
 			}
 			else
 			{
 				//move the data blocks to new location and empty out old data blocks
+				moveExtent(newStartBlock, startBlock, oldSize);
+
 				for(int j = startBlock, i = newStartBlock; j < startBlock + oldSize; j++,i++)
 				{
-
-					void *filePtr = mmap(NULL, 128 * DATA_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, mountedDiskFD, 0);
-
-					memcpy(filePtr + (i * DATA_BLOCK_SIZE), filePtr + (j * DATA_BLOCK_SIZE), DATA_BLOCK_SIZE);
-					memset(filePtr + (j * DATA_BLOCK_SIZE), 0, DATA_BLOCK_SIZE);
-	
 					//mark ith data block as used and jth data block as empty
 					superBlock->free_block_list [i/8] |= (1 << (7 - (i%8)));
 					superBlock->free_block_list [j/8] &= ~(1 << (7 - (j%8)));
@@ -148,110 +767,206 @@ void fs_resize(char name[5], int new_size)
 				//update the inode values
 				superBlock->inode[inodeIdx].start_block = newStartBlock;
 				superBlock->inode[inodeIdx].used_size = 0x80 | new_size;
+
+				relocatedFiles++;
+				traceEvent(TRACE_MOVE, TRACE_RESIZE, inodeIdx, newStartBlock, startBlock, oldSize, countFreeBlocks());
+				traceEvent(TRACE_ALLOC, TRACE_RESIZE, inodeIdx, newStartBlock + oldSize, 0, new_size - oldSize, countFreeBlocks());
 			}
 		}
 	}
+
+	inodeTableSet(&inodeTable, inodeIdx, &superBlock->inode[inodeIdx]);
 	writeSuperBlock();
 }
 
-void fs_defrag(void)
+//Move the first file that follows a free block down onto it. Returns false
+//once the used blocks are contiguous.
+bool defragStep(TraceSource source)
 {
 	int newStartBlock = 0;
-	for(int i = 0; i <= DATA_BLOCK_COUNT; i++)
+	int startBlock = 0;
+
+	//lowest free data block and the first used block after it
+	for(int i = 1; i <= DATA_BLOCK_COUNT && 0 == startBlock; i++)
+	{
+		if(!newStartBlock && !(superBlock->free_block_list[i/8] & (1 << (7 - (i%8)))))
+			newStartBlock = i;
+		else if(newStartBlock && (superBlock->free_block_list[i/8] & (1 << (7 - (i%8)))))
+			startBlock = i;
+	}
+
+	if(0 == startBlock)
+		return false;
+
+	//Find the inode corresponding to this data block
+	int inodeIdx = inodeTableFindStart(&inodeTable, startBlock);
+	if(-1 == inodeIdx)
+		return false;
+
+	int fileSize = superBlock->inode[inodeIdx].used_size & 0x7F;
+
+	markDirty();
+	superBlock->inode[inodeIdx].start_block = newStartBlock;
+	inodeTableSet(&inodeTable, inodeIdx, &superBlock->inode[inodeIdx]);
+
+	moveExtent(newStartBlock, startBlock, fileSize);
+
+	//the file now ends fileSize blocks earlier than it did
+	for(int j = startBlock; j < startBlock + fileSize; j++)
+	{
+		int i = newStartBlock + (j - startBlock);
+		superBlock->free_block_list [i/8] |= (1 << (7 - (i%8)));
+	}
+	for(int j = newStartBlock + fileSize > startBlock ? newStartBlock + fileSize : startBlock; j < startBlock + fileSize; j++)
+		superBlock->free_block_list [j/8] &= ~(1 << (7 - (j%8)));
+
+	traceEvent(TRACE_MOVE, source, inodeIdx, newStartBlock, startBlock, fileSize, countFreeBlocks());
+	return true;
+}
+
+void fs_defrag(void)
+{
+	markDirty();
+
+	while(defragStep(TRACE_DEFRAG))
+		;
+
+	writeSuperBlock();
+}
+
+int fragmentedPercent()
+{
+	int freeBlocks = 0;
+	int runLength = 0;
+	int largestExtent = 0;
+
+	for(int i = 1; i <= DATA_BLOCK_COUNT; i++)
 	{
-		int startBlock = 0;
-		int fileSize = 0;
-		int inodeIdx = 0;
+		if(superBlock->free_block_list[i/8] & (1 << (7 - (i%8))))
+			runLength = 0;
+		else
+		{
+			freeBlocks++;
+			if(++runLength > largestExtent)
+				largestExtent = runLength;
+		}
+	}
+
+	return freeBlocks ? 100 * (freeBlocks - largestExtent) / freeBlocks : 0;
+}
 
-		//check if the ith data block is in use or not.
-		if(superBlock->free_block_list[i/8] & (1 << (7 - (i%8))))
-			continue;
+void *compactorMain(void *arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&fsLock);
 
-		newStartBlock = i;
-		//If a free data block is encountered, iterate to the next used data block.
-		//this data block will be the start_block of the file
-		for(int j = i + 1; j <= DATA_BLOCK_COUNT; j++)
+	while(!compactorStop)
+	{
+		//a waiting command goes first unless it is the compactor's turn
+		if(0 < commandWaiting && !compactorTurn)
 		{
-			if(DATA_BLOCK_COUNT == j && !(superBlock->free_block_list[j/8] & (1 << (7 - (j%8)))))
-			{
-				writeSuperBlock();
-				return;
-			}
-			//If the data block is empty keep moving to the next data block
-			if(!(superBlock->free_block_list[j/8] & (1 << (7 - (j%8)))))
-				continue;
-			startBlock = j;
-			break;
+			pthread_cond_wait(&compactorWake, &fsLock);
+			continue;
 		}
 
-		//Find the inode corresponding to this data block
-		for(int j = 0; j < INODE_COUNT; j++)
+		struct timespec now, idleAt;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		idleAt = lastCommand;
+		idleAt.tv_nsec += COMPACT_IDLE_MS * 1000000L;
+		idleAt.tv_sec += idleAt.tv_nsec / 1000000000L;
+		idleAt.tv_nsec %= 1000000000L;
+
+		bool idle = now.tv_sec > idleAt.tv_sec || (now.tv_sec == idleAt.tv_sec && now.tv_nsec >= idleAt.tv_nsec);
+
+		//past the threshold a single file moves per turn, once idle files
+		//move until a command arrives
+		bool due = -1 != mountedDiskFD && (idle || (compactorTurn && fragmentedPercent() >= compactThreshold));
+		bool moved = due && defragStep(TRACE_COMPACT);
+
+		if(moved)
 		{
-			if(startBlock == superBlock->inode[j].start_block)
-			{
-				inodeIdx = j;
-				break;
-			}
+			writeSuperBlock();
+			aioSubmit();
+			compactedFiles++;
 		}
 
-		fileSize = superBlock->inode[inodeIdx].used_size & 0x7F;
+		if(compactorTurn)
+		{
+			compactorTurn = false;
+			pthread_cond_signal(&commandTurn);
+		}
 
-		//At this point we have the start_block and size of the file.
-		//i -> index of the lowest free data block.
-		
-		//reset the disk FD back to the beginning of the disk in order to move data 
-		//from one data block to another
-		lseek(mountedDiskFD, 0, SEEK_SET);
-		superBlock->inode[inodeIdx].start_block = newStartBlock;
+		if(moved)
+			continue;
 
-		for(int j = startBlock; j < startBlock + fileSize; j++)
-		{
-			void *filePtr = mmap(NULL, 128 * DATA_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, mountedDiskFD, 0);
+		//nothing left to move until the next command changes the disk
+		if(due || idle)
+			pthread_cond_wait(&compactorWake, &fsLock);
+		else
+			pthread_cond_timedwait(&compactorWake, &fsLock, &idleAt);
+	}
 
-			memcpy(filePtr + (i * DATA_BLOCK_SIZE), filePtr + (j * DATA_BLOCK_SIZE), DATA_BLOCK_SIZE);
-			memset(filePtr + (j * DATA_BLOCK_SIZE), 0, DATA_BLOCK_SIZE);
+	pthread_mutex_unlock(&fsLock);
+	return NULL;
+}
 
-			//mark ith data block as used and jth data block as empty
-			superBlock->free_block_list [i/8] |= (1 << (7 - (i%8)));
-			superBlock->free_block_list [j/8] &= ~(1 << (7 - (j%8)));
+void startCompactor()
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&compactorWake, &attr);
+	pthread_condattr_destroy(&attr);
 
-			if(j != startBlock + fileSize - 1)
-				i++;
-		}
+	clock_gettime(CLOCK_MONOTONIC, &lastCommand);
 
-		//currently i is at the original last data block of the file pointed by
-		//inode[inodeIdx].
-		
-		//Update the new startBlock value in the inode
-		//superBlock->inode[inodeIdx].start_block = newStartBlock;
+	if(0 != pthread_create(&compactorThread, NULL, compactorMain, NULL))
+	{
+		fprintf(stderr,"Error: Cannot start the background compactor\n");
+		compactorEnabled = false;
 	}
+}
+
+void stopCompactor()
+{
+	if(!compactorEnabled)
+		return;
+
+	pthread_mutex_lock(&fsLock);
 
-	//writeSuperBlock();
+	//the last command is followed by the compactor's turn as well
+	while(compactorTurn)
+		pthread_cond_wait(&commandTurn, &fsLock);
+	compactorStop = true;
+	pthread_cond_signal(&compactorWake);
+	pthread_mutex_unlock(&fsLock);
+
+	pthread_join(compactorThread, NULL);
+	compactorEnabled = false;
 }
 
 void fs_cd(char name[5])
 {
-	if(0 == strcmp(name,"."))
+	uint8_t dir;
+	char leaf[6];
+
+	if(!resolvePath(name, cwd, &dir, leaf))
 		return;
-	if(0 == strcmp(name,".."))
+
+	if(0 == strcmp(leaf,".") || 0 == strlen(leaf))
 	{
-		if(ROOT_DIR == cwd)
-			return;
-		cwd = superBlock->inode[cwd].dir_parent & 0x7F;
+		cwd = dir;
 		return;
 	}
-
-	int inodeIdx = -1;
-	for(int i = 0; i < INODE_COUNT; i++)
+	if(0 == strcmp(leaf,".."))
 	{
-		if((superBlock->inode[i].used_size & 0x80) && (0 == strncmp(superBlock->inode[i].name,name,5)) &&
-			(cwd == (superBlock->inode[i].dir_parent & 0x7F)))
-		{
-			inodeIdx = i;
-			break;
-		}
+		cwd = (ROOT_DIR == dir) ? dir : superBlock->inode[dir].dir_parent & 0x7F;
+		return;
 	}
 
+	int inodeIdx = inodeTableLookup(&inodeTable, leaf, dir);
+
 	if((-1 == inodeIdx) || !(superBlock->inode[inodeIdx].dir_parent & 0x80))
 	{
 		fprintf(stderr,"Error: Directory %s does not exist\n", name);
@@ -263,15 +978,13 @@ void fs_cd(char name[5])
 
 void fs_read(char name[5], int block_num)
 {
-	int inodeIdx = -1;
-	for(int i = 0; i < INODE_COUNT; i++)
-	{
-		if((superBlock->inode[i].used_size & 0x80) && (0 == strncmp(superBlock->inode[i].name, name, 5)))
-		{
-			inodeIdx = i;
-			break;
-		}
-	}
+	uint8_t dir;
+	char leaf[6];
+
+	if(!resolvePath(name, cwd, &dir, leaf))
+		return;
+
+	int inodeIdx = inodeTableLookup(&inodeTable, leaf, dir);
 
 	if(-1 == inodeIdx || superBlock->inode[inodeIdx].dir_parent & 0x80)
 	{
@@ -290,9 +1003,49 @@ void fs_read(char name[5], int block_num)
 	
 	uint8_t readBlock = startBlock + block_num;
 
-	lseek(mountedDiskFD, readBlock * DATA_BLOCK_SIZE, SEEK_SET);
+	settleBuffer();
+
+	//a read of the block after the previous one continues a sequential stream
+	ReadStream *stream = &readStreams[inodeIdx];
+	bool sequential = (block_num == stream->next);
+	stream->next = block_num + 1;
+	if(!sequential)
+		stream->window = 0;
+	else if(0 == stream->window)
+		stream->window = RA_MIN_WINDOW;
+
+	bool served = true;
+	int contents = (readBlock <= DATA_BLOCK_COUNT) ? contentBlock(readBlock) : readBlock;
+
+	//blocks known to be empty are served without touching the disk
+	if(lazyZero && readBlock <= DATA_BLOCK_COUNT && blockBit(zeroBlockList, readBlock))
+		memset(buffer, '\0', DATA_BLOCK_SIZE);
+	else if(readBlock <= DATA_BLOCK_COUNT && blockMap[contents].length)
+		served = readCompressed(contents, buffer);
+	else if(readAheadHit(contents, buffer))
+		raHits++;
+	else
+		served = false;
+
+	//once the reader gets past the window, fetch the next part of the extent
+	//with a window twice as large
+	int remaining = size - block_num - 1;
+	if(sequential && remaining > 0 && !(readBlock + 1 >= raStart && readBlock + 1 < raStart + raCount))
+	{
+		readAhead(readBlock + 1, remaining < stream->window ? remaining : stream->window);
+		if(stream->window < RA_MAX_WINDOW)
+			stream->window *= 2;
+	}
+
+	if(served)
+		return;
+	if(sequential)
+		raMisses++;
+
 	memset(buffer, '\0', DATA_BLOCK_SIZE);
-	read(mountedDiskFD, buffer, DATA_BLOCK_SIZE);
+	aioRead(mountedDiskFD, buffer, DATA_BLOCK_SIZE, (off_t) contents * DATA_BLOCK_SIZE);
+	aioSubmit();
+	bufferInFlight = true;
 
 }
 
@@ -305,16 +1058,13 @@ void fs_delete(char name[5], int directory)
         return;
     }
 
-	int inodeIdx = -1;
-	for(int i = 0; i < INODE_COUNT; i++)
-	{
-		if((superBlock->inode[i].used_size & 0x80) && (0 == strncmp(superBlock->inode[i].name, name, 5))
-				&& (directory == (superBlock->inode[i].dir_parent & 0x7F)))
-		{	
-			inodeIdx = i;
-			break;
-		}
-	}
+	uint8_t dir;
+	char leaf[6];
+
+	if(!resolvePath(name, directory, &dir, leaf))
+		return;
+
+	int inodeIdx = inodeTableLookup(&inodeTable, leaf, dir);
 
 	if(-1 == inodeIdx)
 	{
@@ -325,29 +1075,39 @@ void fs_delete(char name[5], int directory)
 	//If it is a directory then recursively delete the contents of the directory
 	if(superBlock->inode[inodeIdx].dir_parent & 0x80)
 	{
-		for(int i = 0; i < INODE_COUNT; i++)
+		InodeSet children;
+		inodeTableChildren(&inodeTable, inodeIdx, 0x7F, &children);
+
+		for(int i = inodeSetNext(&children, 0); -1 != i; i = inodeSetNext(&children, i + 1))
 		{
+			//an earlier deletion may already have taken this one
 			if((superBlock->inode[i].used_size & 0x80) && ((superBlock->inode[i].dir_parent & 0x7F) == (inodeIdx)))
 			{
-				fs_delete(superBlock->inode[i].name, (superBlock->inode[i].dir_parent & 0x7F));
+				char childName[6] = {'\0'};
+				memcpy(childName, superBlock->inode[i].name, 5);
+				fs_delete(childName, (superBlock->inode[i].dir_parent & 0x7F));
 			}
 		}
 	}
 
+	markDirty();
+
 	int startBlock = superBlock->inode[inodeIdx].start_block;
 	int size = superBlock->inode[inodeIdx].used_size & 0x7F;
 
 	//Delete the data blocks used by the file
 	for(int i = startBlock; i < startBlock + size; i++)
 	{
-		void *filePtr = mmap(NULL, 128 * DATA_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, mountedDiskFD, 0);
-		
-		memset(filePtr + (i * DATA_BLOCK_SIZE), 0, DATA_BLOCK_SIZE);
+		zeroDataBlock(i);
 
 		superBlock->free_block_list[i/8] &= ~(1 << (7 - (i%8)));
 	}
 
+	if(0 < size)
+		traceEvent(TRACE_FREE, TRACE_DELETE, inodeIdx, startBlock, 0, size, countFreeBlocks());
+
 	memset(&superBlock->inode[inodeIdx], 0, sizeof(Inode));
+	inodeTableSet(&inodeTable, inodeIdx, &superBlock->inode[inodeIdx]);
 	writeSuperBlock();
 
 }
@@ -360,85 +1120,146 @@ void fs_ls(void)
         return;
     }
 
+	InodeSet entries, children;
 	int currDirCount = 0;
 	int prevDirCount = 0;
 
-	for(int i = 0; i < INODE_COUNT; i++)
-	{
-		if((superBlock->inode[i].used_size & 0x80) && (superBlock->inode[i].dir_parent & 0x7F) == cwd)
-		{
-			currDirCount++;
-		}
-	}
+	inodeTableChildren(&inodeTable, cwd, 0x7F, &entries);
+	currDirCount = inodeSetCount(&entries);
 
 	if(ROOT_DIR != cwd)
 	{
 		int parentDir = superBlock->inode[cwd].dir_parent & 0x7F;
-		for(int i = 0; i < INODE_COUNT; i++)
-		{
-			if((superBlock->inode[i].used_size & 0x80) && (superBlock->inode[i].dir_parent & 0x7F) == parentDir)
-			{
-				prevDirCount++;
-			}
-		}
+		inodeTableChildren(&inodeTable, parentDir, 0x7F, &children);
+		prevDirCount = inodeSetCount(&children);
 	}
 
 	fprintf(stdout,".     %3d\n", currDirCount + 2);
 	fprintf(stdout,"..    %3d\n", (ROOT_DIR == cwd) ? currDirCount + 2 : prevDirCount + 2);
 
-	for(int i = 0; i < INODE_COUNT; i++)
+	for(int i = inodeSetNext(&entries, 0); -1 != i; i = inodeSetNext(&entries, i + 1))
 	{
 		prevDirCount = 0;
-		if((superBlock->inode[i].used_size & 0x80) && (superBlock->inode[i].dir_parent & 0x7F) == cwd)
+		if(superBlock->inode[i].dir_parent & 0x80)
 		{
-			if(superBlock->inode[i].dir_parent & 0x80)
+			inodeTableChildren(&inodeTable, i, 0x7F, &children);
+			prevDirCount = inodeSetCount(&children);
+
+			for(int j = 0; j < 5; j++)
 			{
-				int currParentDir = i;
-				for(int j = 0; j < INODE_COUNT; j++)
-				{
-					if((superBlock->inode[j].used_size & 0x80) && (superBlock->inode[j].dir_parent & 0x7F) == currParentDir)
-					{
-						prevDirCount++;
-					}
-				}
-				for(int j = 0; j < 5; j++)
-				{
-					if(superBlock->inode[i].name[j] != '\0')
-						fprintf(stdout,"%c",superBlock->inode[i].name[j]);
-					else
-						fprintf(stdout," ");
-				}
-					fprintf(stdout," %3d\n", prevDirCount + 2);
+				if(superBlock->inode[i].name[j] != '\0')
+					fprintf(stdout,"%c",superBlock->inode[i].name[j]);
+				else
+					fprintf(stdout," ");
 			}
-			else
+				fprintf(stdout," %3d\n", prevDirCount + 2);
+		}
+		else
+		{
+			for(int j = 0; j < 5; j++)
 			{
-				for(int j = 0; j < 5; j++)
-                {
-                    if(superBlock->inode[i].name[j] != '\0')
-                        fprintf(stdout,"%c",superBlock->inode[i].name[j]);
-                    else
-                        fprintf(stdout," ");
-                }
-                    fprintf(stdout," %3d KB\n", superBlock->inode[i].used_size & 0x7f);
+				if(superBlock->inode[i].name[j] != '\0')
+					fprintf(stdout,"%c",superBlock->inode[i].name[j]);
+				else
+					fprintf(stdout," ");
 			}
+				fprintf(stdout," %3d KB\n", superBlock->inode[i].used_size & 0x7f);
 		}
 	}
 }
 
-void fs_write(char name[5], int block_num)
+void fs_frag(void)
 {
-	//check if the file with the given name exists
-	int inodeIdx = -1;
-	for(int i = 0; i < INODE_COUNT; i++)
+	if(-1 == mountedDiskFD)
+	{
+        fprintf(stderr,"Error: No file system is mounted\n");
+        return;
+    }
+
+	//free extents bucketed by size: 1, 2-3, 4-7, ..., 64-127
+	int histogram[7] = {0};
+	int freeBlocks = 0;
+	int freeExtents = 0;
+	int largestExtent = 0;
+
+	for(int i = 1; i <= DATA_BLOCK_COUNT; i++)
 	{
-		if((superBlock->inode[i].used_size & 0x80) && (0 == strncmp(superBlock->inode[i].name, name, 5))
-				&& (cwd == (superBlock->inode[i].dir_parent & 0x7F)))
+		if(superBlock->free_block_list[i/8] & (1 << (7 - (i%8))))
+			continue;
+
+		int runLength = 0;
+		while(i <= DATA_BLOCK_COUNT && !(superBlock->free_block_list[i/8] & (1 << (7 - (i%8)))))
 		{
-			inodeIdx = i;
-			break;
+			runLength++;
+			i++;
 		}
+
+		freeBlocks += runLength;
+		freeExtents++;
+		if(runLength > largestExtent)
+			largestExtent = runLength;
+		histogram[31 - __builtin_clz(runLength)]++;
+	}
+
+	//share of the free space that is not in the largest extent
+	double fragmented = freeBlocks ? 100.0 * (freeBlocks - largestExtent) / freeBlocks : 0.0;
+
+	fprintf(stdout,"Free blocks          %3d\n", freeBlocks);
+	fprintf(stdout,"Free extents         %3d\n", freeExtents);
+	fprintf(stdout,"Largest free extent  %3d\n", largestExtent);
+	fprintf(stdout,"Fragmented           %5.1f%%\n", fragmented);
+
+	for(int i = 0; i < 7; i++)
+	{
+		int low = 1 << i;
+		int high = (6 == i) ? DATA_BLOCK_COUNT : (2 << i) - 1;
+		fprintf(stdout,"Extents %3d-%-3d      %3d\n", low, high, histogram[i]);
 	}
 
+	fprintf(stdout,"Relocated by resize  %3d\n", relocatedFiles);
+	fprintf(stdout,"Fragmented failures  %3d\n", fragmentedFails);
+	fprintf(stdout,"Readahead hits       %3d\n", raHits);
+	fprintf(stdout,"Readahead misses     %3d\n", raMisses);
+	fprintf(stdout,"Readahead blocks     %3d\n", raBlocks);
+
+	if(compactorEnabled)
+		fprintf(stdout,"Compacted files      %3d\n", compactedFiles);
+
+	if(compressBlocks)
+	{
+		int compressed = 0;
+		for(int i = 0; i <= DATA_BLOCK_COUNT; i++)
+			compressed += (0 != blockMap[i].length);
+
+		fprintf(stdout,"Compressed blocks    %3d\n", compressed);
+		fprintf(stdout,"Compression ratio    %5.2f\n", storedBytes ? (double) logicalBytes / storedBytes : 1.0);
+		fprintf(stdout,"Codec time           compress %llu us, decompress %llu us\n",
+				(unsigned long long) (compressNs / 1000), (unsigned long long) (decompressNs / 1000));
+	}
+
+	if(dedupBlocks)
+	{
+		int shared = 0;
+		for(int i = 1; i <= DATA_BLOCK_COUNT; i++)
+			shared += (0 != blockMap[i].target);
+
+		fprintf(stdout,"Shared blocks        %3d\n", shared);
+		fprintf(stdout,"Deduplicated writes  %3d\n", dedupWrites);
+		fprintf(stdout,"Copy-on-write copies %3d\n", copyOnWrites);
+	}
+}
+
+void fs_write(char name[5], int block_num)
+{
+	uint8_t dir;
+	char leaf[6];
+
+	if(!resolvePath(name, cwd, &dir, leaf))
+		return;
+
+	//check if the file with the given name exists
+	int inodeIdx = inodeTableLookup(&inodeTable, leaf, dir);
+
 	if(-1 == inodeIdx || superBlock->inode[inodeIdx].dir_parent & 0x80)
 	{
 		fprintf(stderr,"Error: File %s does not exist\n",name);
@@ -457,9 +1278,36 @@ void fs_write(char name[5], int block_num)
 	int startBlock = superBlock->inode[inodeIdx].start_block;
 	int writeBlock = startBlock + block_num;
 
-	lseek(mountedDiskFD, writeBlock * DATA_BLOCK_SIZE, SEEK_SET);
-	write(mountedDiskFD, buffer, DATA_BLOCK_SIZE);
+	settleBuffer();
+	unshareBlock(writeBlock);
+
+	//contents already stored elsewhere are shared instead of written again
+	uint32_t hash = dedupBlocks ? crc32c(0, buffer, DATA_BLOCK_SIZE) : 0;
+	if(!dedupBlocks || !shareBlock(writeBlock, hash))
+	{
+		if(compressBlocks)
+			writeCompressed(writeBlock);
+		else
+		{
+			blockMap[writeBlock].length = 0;
+			writeDataBlock(buffer, DATA_BLOCK_SIZE, writeBlock);
+		}
+
+		if(dedupBlocks)
+		{
+			blockMap[writeBlock].hash = hash;
+			blockMap[writeBlock].hashed = 1;
+			blockMapUsed = true;
+		}
+	}
+
+	//a block that is shared now is not zero, though its own slot may still
+	//have to be zeroed
+	if(lazyZero)
+		setBlockBit(zeroBlockList, writeBlock, false);
 
+	//a shared write changes nothing but the map
+	writeBlockMap();
 }
 
 void fs_buff(char buff[1024])
@@ -470,6 +1318,7 @@ void fs_buff(char buff[1024])
 		return;
 	}
 
+	settleBuffer();
 	memset(buffer, '\0', sizeof(buffer));
 
 	for(int i = 0; (i < 1024) && (buff[i] != '\0'); i++)
@@ -486,81 +1335,398 @@ void fs_create(char name[5], int size)
     }
 
 
-	int free_inode_idx = -1;
+	//check for a free inode
+	int free_inode_idx = inodeTableFirstFree(&inodeTable);
+
+	if(-1 == free_inode_idx)
+	{	
+		fprintf(stderr,"Error: Superblock in disk %s is full, cannot create %s\n", diskName, name);
+		return;
+	}
+
+	uint8_t dir;
+	char leaf[6];
+
+	if(!resolvePath(name, cwd, &dir, leaf))
+		return;
+
+	//check if the file or directory name is unique in the curernt working directory
+	if(-1 != inodeTableFind(&inodeTable, leaf, dir, 0xFF))
+	{
+		fprintf(stderr,"Error: File or directory %s already exists\n", name);
+		return;
+	}
+
+	//check if contiguous blocks are available
+	int start_block = -1;
+	if (0 < size)
+	{
+		int free_block_count = 0;
+
+		for(int i = 1; i <= DATA_BLOCK_COUNT; i++)
+		{
+			if(!(superBlock->free_block_list[i/8] & (1 << (7 - (i%8)))))
+			{
+				free_block_count++;
+				if(free_block_count == size)
+				{
+					start_block = i - size + 1;
+					break;
+				}
+			}
+		else
+			free_block_count = 0; //reset
+		}
+
+		if(-1 == start_block)
+		{
+			fprintf(stderr,"Error: Cannot allocate %d blocks on %s\n", size, diskName);
+
+			if(countFreeBlocks() >= size)
+				fragmentedFails++;
+			traceEvent(TRACE_ALLOC_FAIL, TRACE_CREATE, free_inode_idx, 0, 0, size, countFreeBlocks());
+			return;
+		}
+	}
+
+	markDirty();
+
+	//mark data blocks as allocated
+	for(int i = start_block; i < start_block + size; i++)
+		superBlock->free_block_list[i/8] |= (1 << (7 - (i%8)));
+
+	strncpy(superBlock->inode[free_inode_idx].name, leaf, 5);
+
+	//populate the inode parameters
+	//Mark the 8th bit as used and set the remaining bits as the size of the file
+	superBlock->inode[free_inode_idx].used_size = 0x80 | size;
+
+	//Mark the start_block as 0 if it is a directory
+	superBlock->inode[free_inode_idx].start_block = (size > 0) ? start_block : 0;
+
+	//If it is a directory mark the 8th bit as 1 and set the remaining bits to the CWD
+	superBlock->inode[free_inode_idx].dir_parent = (size == 0) ? 0x80 | dir : dir;
+	inodeTableSet(&inodeTable, free_inode_idx, &superBlock->inode[free_inode_idx]);
+	writeSuperBlock();
+
+	if(0 < size)
+		traceEvent(TRACE_ALLOC, TRACE_CREATE, free_inode_idx, start_block, 0, size, countFreeBlocks());
+
+}
+
+//One file or directory of a host tree being imported. Entries are listed
+//parents first; parent is the index of the parent entry, or -1 for the
+//current directory.
+typedef struct {
+	char name[6];
+	char hostPath[PATH_MAX_LEN];
+	int parent;
+	int blocks;  // 0 for a directory
+	int start;
+	int inode;
+} ImportEntry;
+
+//Append the contents of the host directory dirPath to entries, in name order
+//and parents first. Returns the new entry count, or -1 after an error.
+int planImportDir(char *dirPath, int parent, ImportEntry *entries, int count)
+{
+	struct dirent **names;
+	int nameCount = scandir(dirPath, &names, NULL, alphasort);
+
+	if(0 > nameCount)
+	{
+		fprintf(stderr,"Error: Cannot open %s\n", dirPath);
+		return -1;
+	}
+
+	for(int i = 0; i < nameCount && -1 != count; i++)
+	{
+		char *name = names[i]->d_name;
+		char hostPath[PATH_MAX_LEN];
+		struct stat st;
+
+		if(0 == strcmp(name, ".") || 0 == strcmp(name, ".."))
+			continue;
+
+		if(5 < strlen(name))
+		{
+			fprintf(stderr,"Error: Cannot import %s/%s, names are at most 5 characters\n", dirPath, name);
+			count = -1;
+		}
+		else if((int) sizeof(hostPath) <= snprintf(hostPath, sizeof(hostPath), "%s/%s", dirPath, name))
+		{
+			fprintf(stderr,"Error: Cannot import %s/%s, the path is too long\n", dirPath, name);
+			count = -1;
+		}
+		else if(0 != stat(hostPath, &st) || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+		{
+			fprintf(stderr,"Error: Cannot import %s, not a file or directory\n", hostPath);
+			count = -1;
+		}
+		else if(S_ISREG(st.st_mode) && st.st_size > (off_t) DATA_BLOCK_COUNT * DATA_BLOCK_SIZE)
+		{
+			fprintf(stderr,"Error: Cannot import %s, files are at most %d blocks\n", hostPath, DATA_BLOCK_COUNT);
+			count = -1;
+		}
+		else if(INODE_COUNT == count)
+		{
+			fprintf(stderr,"Error: Superblock in disk %s is full, cannot import %s\n", diskName, hostPath);
+			count = -1;
+		}
+		else
+		{
+			ImportEntry *entry = &entries[count];
+			strcpy(entry->name, name);
+			strcpy(entry->hostPath, hostPath);
+			entry->parent = parent;
+			//a file of size 0 would be a directory, empty files get one block
+			entry->blocks = S_ISDIR(st.st_mode) ? 0 : (st.st_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+			if(S_ISREG(st.st_mode) && 0 == entry->blocks)
+				entry->blocks = 1;
+			count++;
+
+			if(S_ISDIR(st.st_mode))
+				count = planImportDir(hostPath, count - 1, entries, count);
+		}
+	}
+
+	for(int i = 0; i < nameCount; i++)
+		free(names[i]);
+	free(names);
+	return count;
+}
+
+//First run of count blocks that are free in freeList, or -1
+int findFreeRun(char *freeList, int count)
+{
+	int runLength = 0;
+
+	for(int i = 1; i <= DATA_BLOCK_COUNT; i++)
+	{
+		runLength = blockBit(freeList, i) ? 0 : runLength + 1;
+		if(runLength == count)
+			return i - count + 1;
+	}
+	return -1;
+}
+
+//Copy the host directory tree at hostPath into the current directory. Every
+//name, inode and block is planned before anything is changed, so the import
+//either fails as a whole or lands with one data write per run of blocks and
+//a single superblock write.
+void fs_import(char *hostPath)
+{
+	static ImportEntry entries[INODE_COUNT];
+	static char staging[DATA_BLOCK_COUNT + 1][DATA_BLOCK_SIZE] __attribute__((aligned(DIRECT_IO_ALIGN)));
+	char freeList[FREE_SPACE_SIZE];
+
+	if(-1 == mountedDiskFD)
+	{
+		fprintf(stderr,"Error: No file system is mounted\n");
+		return;
+	}
+
+	int count = planImportDir(hostPath, -1, entries, 0);
+	if(-1 == count)
+		return;
+
+	int freeInodes = 0;
+	for(int i = 0; i < INODE_COUNT; i++)
+		freeInodes += !(superBlock->inode[i].used_size & 0x80);
+
+	if(count > freeInodes)
+	{
+		fprintf(stderr,"Error: Superblock in disk %s is full, cannot import %s\n", diskName, hostPath);
+		return;
+	}
+
+	for(int k = 0; k < count; k++)
+	{
+		char name[5] = {'\0'};
+		strncpy(name, entries[k].name, 5);
+		if(-1 == entries[k].parent && -1 != inodeTableFind(&inodeTable, name, cwd, 0x7F))
+		{
+			fprintf(stderr,"Error: File or directory %s already exists\n", entries[k].name);
+			return;
+		}
+	}
+
+	//place all files back to back if one free run holds them, else each file
+	//in the first run it fits
+	int totalBlocks = 0;
+	for(int k = 0; k < count; k++)
+		totalBlocks += entries[k].blocks;
+
+	memcpy(freeList, superBlock->free_block_list, FREE_SPACE_SIZE);
+	int next = (0 < totalBlocks) ? findFreeRun(freeList, totalBlocks) : -1;
 
-	//check for a free inode
-	for(int i = 0; i < INODE_COUNT; i++)
+	for(int k = 0; k < count; k++)
 	{
-		if(!(superBlock->inode[i].used_size & 0x80))
+		if(0 == entries[k].blocks)
+			continue;
+
+		entries[k].start = (-1 != next) ? next : findFreeRun(freeList, entries[k].blocks);
+		if(-1 == entries[k].start)
 		{
-			free_inode_idx = i;
-			break;
+			fprintf(stderr,"Error: Cannot allocate %d blocks on %s\n", entries[k].blocks, diskName);
+			if(countFreeBlocks() >= totalBlocks)
+				fragmentedFails++;
+			return;
 		}
-	}
 
-	if(-1 == free_inode_idx)
-	{	
-		fprintf(stderr,"Error: Superblock in disk %s is full, cannot create %s\n", diskName, name);
-		return;
+		if(-1 != next)
+			next += entries[k].blocks;
+		for(int i = entries[k].start; i < entries[k].start + entries[k].blocks; i++)
+			setBlockBit(freeList, i, true);
 	}
 
-	//check if the file or directory name is unique in the curernt working directory
-	for(int i = 0; i < INODE_COUNT; i++)
+	//stage the file contents in place, zero padded to whole blocks
+	for(int k = 0; k < count; k++)
 	{
-		if((superBlock->inode[i].used_size & 0x80) && 
-				(superBlock->inode[i].dir_parent == cwd) && 
-				(0 == strncmp(superBlock->inode[i].name, name, 5)))
+		if(0 == entries[k].blocks)
+			continue;
+
+		char *dst = staging[entries[k].start];
+		size_t length = (size_t) entries[k].blocks * DATA_BLOCK_SIZE;
+		size_t done = 0;
+		int fd = open(entries[k].hostPath, O_RDONLY);
+
+		if(-1 == fd)
 		{
-			fprintf(stderr,"Error: File or directory %s already exists\n", name);
+			fprintf(stderr,"Error: Cannot open %s\n", entries[k].hostPath);
 			return;
 		}
+
+		ssize_t got;
+		while(done < length && 0 < (got = read(fd, dst + done, length - done)))
+			done += got;
+		memset(dst + done, '\0', length - done);
+		close(fd);
 	}
 
-	//check if contiguous blocks are available
-	int start_block = -1;
-	if (0 < size)
+	settleBuffer();
+	aioDrain();
+	raCount = 0;
+	markDirty();
+
+	for(int i = 1; i <= DATA_BLOCK_COUNT; i++)
 	{
-		int free_block_count = 0;
+		if(!blockBit(freeList, i) || blockBit(superBlock->free_block_list, i))
+			continue;
 
-		for(int i = 1; i <= DATA_BLOCK_COUNT; i++)
+		int runStart = i;
+		while(i <= DATA_BLOCK_COUNT && blockBit(freeList, i) && !blockBit(superBlock->free_block_list, i))
 		{
-			if(!(superBlock->free_block_list[i/8] & (1 << (7 - (i%8)))))
+			memset(&blockMap[i], 0, sizeof(BlockMapEntry));
+			if(lazyZero)
 			{
-				free_block_count++;
-				if(free_block_count == size)
-				{
-					start_block = i - size + 1;
-					break;
-				}
+				setBlockBit(zeroBlockList, i, false);
+				setBlockBit(pendingZeroList, i, false);
 			}
-		else
-			free_block_count = 0; //reset
+			i++;
 		}
 
-		if(-1 == start_block)
+		size_t length = (size_t) (i - runStart) * DATA_BLOCK_SIZE;
+		if((ssize_t) length != pwrite(mountedDiskFD, staging[runStart], length, (off_t) runStart * DATA_BLOCK_SIZE))
+			fprintf(stderr,"Error: Cannot write blocks %d to %d of %s\n", runStart, i - 1, diskName);
+	}
+	memcpy(superBlock->free_block_list, freeList, FREE_SPACE_SIZE);
+
+	for(int k = 0; k < count; k++)
+	{
+		int idx = inodeTableFirstFree(&inodeTable);
+		uint8_t parent = (-1 == entries[k].parent) ? cwd : entries[entries[k].parent].inode;
+		Inode *inode = &superBlock->inode[idx];
+
+		strncpy(inode->name, entries[k].name, 5);
+		inode->used_size = 0x80 | entries[k].blocks;
+		inode->start_block = entries[k].blocks ? entries[k].start : 0;
+		inode->dir_parent = entries[k].blocks ? parent : 0x80 | parent;
+		inodeTableSet(&inodeTable, idx, inode);
+		entries[k].inode = idx;
+	}
+	writeSuperBlock();
+
+	for(int k = 0; k < count; k++)
+	{
+		if(entries[k].blocks)
+			traceEvent(TRACE_ALLOC, TRACE_IMPORT, entries[k].inode, entries[k].start, 0, entries[k].blocks, countFreeBlocks());
+	}
+}
+
+//Write the files and directories under dir to the host directory hostPath,
+//each file with a single read of its extent and a single write
+bool exportDir(uint8_t dir, char *hostPath)
+{
+	static char staging[DATA_BLOCK_COUNT + 1][DATA_BLOCK_SIZE] __attribute__((aligned(DIRECT_IO_ALIGN)));
+	InodeSet children;
+
+	if(0 != mkdir(hostPath, 0777) && EEXIST != errno)
+	{
+		fprintf(stderr,"Error: Cannot create %s\n", hostPath);
+		return false;
+	}
+
+	inodeTableChildren(&inodeTable, dir, 0x7F, &children);
+	for(int i = inodeSetNext(&children, 0); -1 != i; i = inodeSetNext(&children, i + 1))
+	{
+		Inode *inode = &superBlock->inode[i];
+		char childPath[PATH_MAX_LEN];
+
+		if((int) sizeof(childPath) <= snprintf(childPath, sizeof(childPath), "%s/%.5s", hostPath, inode->name))
 		{
-			fprintf(stderr,"Error: Cannot allocate %d blocks on %s\n", size, diskName);
-			return;
+			fprintf(stderr,"Error: Cannot write %s/%.5s, the path is too long\n", hostPath, inode->name);
+			return false;
 		}
 
-		//mark data blocks as allocated
-		for(int i = start_block; i < start_block + size; i++)
-			superBlock->free_block_list[i/8] |= (1 << (7 - (i%8)));
-	}
+		if(inode->dir_parent & 0x80)
+		{
+			if(!exportDir(i, childPath))
+				return false;
+			continue;
+		}
 
-	strncpy(superBlock->inode[free_inode_idx].name, name, 5);
+		int start = inode->start_block;
+		int size = inode->used_size & 0x7F;
+		size_t length = (size_t) size * DATA_BLOCK_SIZE;
 
-	//populate the inode parameters
-	//Mark the 8th bit as used and set the remaining bits as the size of the file
-	superBlock->inode[free_inode_idx].used_size = 0x80 | size;
+		if((ssize_t) length != pread(mountedDiskFD, staging, length, (off_t) start * DATA_BLOCK_SIZE))
+			memset(staging, '\0', length);
 
-	//Mark the start_block as 0 if it is a directory
-	superBlock->inode[free_inode_idx].start_block = (size > 0) ? start_block : 0;
+		//blocks that are not stored as is in their own slot
+		for(int k = 0; k < size; k++)
+		{
+			int block = start + k;
+			if(blockMap[block].target || blockMap[block].length || (lazyZero && blockBit(zeroBlockList, block)))
+				readContents(block, staging[k]);
+		}
 
-	//If it is a directory mark the 8th bit as 1 and set the remaining bits to the CWD
-	superBlock->inode[free_inode_idx].dir_parent = (size == 0) ? 0x80 | cwd : cwd;
-	writeSuperBlock();
+		int fd = open(childPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if(-1 == fd || (ssize_t) length != write(fd, staging, length))
+		{
+			fprintf(stderr,"Error: Cannot write %s\n", childPath);
+			if(-1 != fd)
+				close(fd);
+			return false;
+		}
+		close(fd);
+	}
+	return true;
+}
+
+//Copy the current directory, with everything under it, to the host
+//directory hostPath
+void fs_export(char *hostPath)
+{
+	if(-1 == mountedDiskFD)
+	{
+		fprintf(stderr,"Error: No file system is mounted\n");
+		return;
+	}
 
+	settleBuffer();
+	aioDrain();
+	exportDir(cwd, hostPath);
 }
 
 int inodeConsistencyCheck(char *diskName)
@@ -635,21 +1801,19 @@ int inodeConsistencyCheck(char *diskName)
 		}
 	}
 
-	//Check if every file/directory is unique in every directory
+	//Check if every file/directory is unique in every directory. The first
+	//inode with a given name and parent is the inode itself unless an earlier
+	//one has the same name.
+	static InodeTable checkTable;
+	inodeTableLoad(&checkTable, temp_superBlock);
+
 	for(int i = 0; i < INODE_COUNT; i++)
 	{
-		if(temp_superBlock->inode[i].used_size & 0x80)
+		if((temp_superBlock->inode[i].used_size & 0x80) &&
+				i != inodeTableFind(&checkTable, temp_superBlock->inode[i].name, temp_superBlock->inode[i].dir_parent, 0xFF))
 		{
-			for(int j = i+1; j < INODE_COUNT; j++)
-			{
-				if((temp_superBlock->inode[j].used_size & 0x80) && 
-						0 == strncmp(temp_superBlock->inode[j].name, temp_superBlock->inode[i].name,5) && 
-						temp_superBlock->inode[i].dir_parent == temp_superBlock->inode[j].dir_parent)
-				{
-					fprintf(stderr,"Error: File system in %s is inconsistent (error code: 5)\n",diskName);
-					return 1;
-				}
-			}
+			fprintf(stderr,"Error: File system in %s is inconsistent (error code: 5)\n",diskName);
+			return 1;
 		}
 	}
 
@@ -683,9 +1847,10 @@ int inodeConsistencyCheck(char *diskName)
 		return -1;
 	}
 
+	//directories and empty files own no blocks, so they cannot overlap
 	for(int i = 0 ; i < INODE_COUNT; i++)
 	{
-		if(!(temp_superBlock->inode[i].used_size & 0x80))
+		if(!(temp_superBlock->inode[i].used_size & 0x80) || !(temp_superBlock->inode[i].used_size & 0x7F))
 			continue;
 
 		int startBlock = temp_superBlock->inode[i].start_block;
@@ -693,7 +1858,7 @@ int inodeConsistencyCheck(char *diskName)
 
 		for(int j = i + 1; j < INODE_COUNT; j++)
 		{
-			if(!(temp_superBlock->inode[j].used_size & 0x80))
+			if(!(temp_superBlock->inode[j].used_size & 0x80) || !(temp_superBlock->inode[j].used_size & 0x7F))
 				continue;
 			if(temp_superBlock->inode[j].start_block == startBlock && 
 					(temp_superBlock->inode[j].used_size & 0x7F) == (temp_superBlock->inode[i].used_size & 0x7F))
@@ -722,102 +1887,266 @@ int inodeConsistencyCheck(char *diskName)
 	return 0;
 }
 
-void fs_mount(char *new_disk_name)
+//Switch the disk over to direct I/O if the file system supports it with the
+//block size and buffer alignment used here. Buffers of several blocks hand
+//their blocks to the disk one by one, so memory only has to be aligned to a
+//block. Without STATX_DIOALIGN a block read into such a buffer is tried.
+bool enableDirectIO(int fd)
+{
+	bool checked = false;
+
+#ifdef STATX_DIOALIGN
+	struct statx dioStat;
+	if(0 == statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &dioStat) && (dioStat.stx_mask & STATX_DIOALIGN))
+	{
+		if(0 == dioStat.stx_dio_offset_align || DATA_BLOCK_SIZE % dioStat.stx_dio_offset_align ||
+				0 == dioStat.stx_dio_mem_align || DATA_BLOCK_SIZE % dioStat.stx_dio_mem_align)
+			return false;
+		checked = true;
+	}
+#endif
+
+	int flags = fcntl(fd, F_GETFL);
+	if(-1 == flags || 0 != fcntl(fd, F_SETFL, flags | O_DIRECT))
+		return false;
+
+	if(!checked)
+	{
+		//the second block of the buffer is aligned to a block and no more
+		static uint8_t probe[2 * DATA_BLOCK_SIZE] __attribute__((aligned(DIRECT_IO_ALIGN)));
+
+		if(-1 == pread(fd, probe + DATA_BLOCK_SIZE, DATA_BLOCK_SIZE, 0))
+		{
+			fcntl(fd, F_SETFL, flags);
+			return false;
+		}
+	}
+	return true;
+}
+
+//Bring the superblock of the disk to be mounted into memory. It is normally
+//mapped and checked in place; with direct I/O it is read into an aligned
+//buffer instead so that it does not go through the page cache.
+Superblock *loadTempSuperBlock(int fd, bool direct)
+{
+	if(!direct)
+	{
+		void *sb = mmap(NULL, sizeof(Superblock), PROT_READ, MAP_SHARED, fd, 0);
+		return (MAP_FAILED == sb) ? NULL : sb;
+	}
+
+	void *sb = NULL;
+	if(0 != posix_memalign(&sb, DIRECT_IO_ALIGN, sizeof(Superblock)))
+		return NULL;
+
+	if((ssize_t) sizeof(Superblock) != pread(fd, sb, sizeof(Superblock), 0))
+	{
+		free(sb);
+		return NULL;
+	}
+
+	return sb;
+}
+
+void releaseTempSuperBlock(bool direct)
+{
+	if(direct)
+		free(temp_superBlock);
+	else
+		munmap(temp_superBlock, sizeof(Superblock));
+	temp_superBlock = NULL;
+}
+
+//The counters F reports describe the mounted disk only
+void resetDiskCounters()
 {
-	//Create a temporary superBlock that will check the consistency of the disk 
-	//to be mounted
-	temp_superBlock = (Superblock*) malloc (sizeof(Superblock));
-	memset(temp_superBlock, 0, sizeof(Superblock));
+	relocatedFiles = 0;
+	fragmentedFails = 0;
+	compactedFiles = 0;
+	logicalBytes = 0;
+	storedBytes = 0;
+	compressNs = 0;
+	decompressNs = 0;
+	dedupWrites = 0;
+	copyOnWrites = 0;
+	raHits = 0;
+	raMisses = 0;
+	raBlocks = 0;
+}
 
+void fs_mount(char *new_disk_name)
+{
 	diskFD = open(new_disk_name, O_RDWR);
 
 	if(0 > diskFD)
 	{
 		fprintf(stderr,"Error: Cannot find disk %s\n", new_disk_name);
-		free(temp_superBlock);
 		return;
 	}
 
-	//reset the diskFD to the start of the virtual disk
-	lseek(diskFD, 0, SEEK_SET);
+	struct stat diskStat;
 
-	//load the free_block_list from the superblock
-	if(FREE_SPACE_SIZE != read(diskFD, temp_superBlock->free_block_list, FREE_SPACE_SIZE))
+	//the free_block_list has to be present in the superblock
+	if(0 != fstat(diskFD, &diskStat) || FREE_SPACE_SIZE > diskStat.st_size)
 	{
 		fprintf(stderr,"Error: Cannot read the superblock\n");
 		close(diskFD);
 		diskFD = -1;
-		free(temp_superBlock);
 		return;
 	}
 
-	//load the inode array from the superblock
-	if(INODE_LIST_SIZE != read(diskFD, temp_superBlock->inode, INODE_LIST_SIZE * sizeof(char)))
+	//so does the whole inode array
+	if((off_t) sizeof(Superblock) > diskStat.st_size)
 	{
 		fprintf(stderr,"Error: Cannot read inodes\n");
 		close(diskFD);
 		diskFD = -1;
-		free(temp_superBlock);
 		return;
 	}
 
+	bool direct = directIO && enableDirectIO(diskFD);
+
+	if(directIO && !direct)
+		fprintf(stderr,"Error: Direct I/O is not supported on disk %s\n", new_disk_name);
+
+	//Map the superblock of the disk to be mounted and check its consistency
+	//in place instead of reading it into a temporary copy first
+	temp_superBlock = loadTempSuperBlock(diskFD, direct);
+
+	if(NULL == temp_superBlock)
+	{
+		fprintf(stderr,"Error: Cannot read the superblock\n");
+		close(diskFD);
+		diskFD = -1;
+		return;
+	}
+
+	//A disk that was cleanly written by this process and whose superblock
+	//still carries the same checksum was already found consistent, so the
+	//full scan can be skipped. Anything else gets the full check.
+	DiskState *state = findDiskState(&diskStat);
+	uint32_t checksum = crc32c(0, temp_superBlock, sizeof(Superblock));
+	bool skipCheck = state->clean && state->checksum == checksum;
+
 	//inode consistency check
-	if(inodeConsistencyCheck(new_disk_name))
+	if(!skipCheck && inodeConsistencyCheck(new_disk_name))
 	{
+		releaseTempSuperBlock(direct);
 		close(diskFD);
 		diskFD = -1;
-		free(temp_superBlock);
 		return;
 	}
-	
-	//reset the diskFD to the beginning of the disk
-	lseek(diskFD, 0, SEEK_SET);
+
+	//compressed or shared blocks cannot be read without their map
+	static BlockMapEntry newMap[DATA_BLOCK_COUNT + 1];
+	char newMapName[sizeof(blockMapName)];
+
+	//the mounted disk may be the same disk, its map has to be on file first
+	if(-1 != mountedDiskFD)
+	{
+		writeBlockMap();
+		dropBlockMap();
+	}
+
+	snprintf(newMapName, sizeof(newMapName), "%s.map", new_disk_name);
+	int mapState = readBlockMap(newMapName, newMap);
+
+	//a disk marked as having a map cannot be read without it either
+	bool mapMissing = 0 == mapState && -1 != fgetxattr(diskFD, BLOCK_MAP_XATTR, NULL, 0);
+
+	if(-1 == mapState || mapMissing)
+	{
+		fprintf(stderr,"Error: Block map %s is %s, cannot mount disk %s\n", newMapName,
+				mapMissing ? "missing" : "damaged", new_disk_name);
+		releaseTempSuperBlock(direct);
+		close(diskFD);
+		diskFD = -1;
+		return;
+	}
+
+	state->checksum = checksum;
+	state->clean = true;
+
+	//Unmount the previously mounted disk
+	unmountDisk();
 
 	//Update the mounted disk FD
 	mountedDiskFD = diskFD;
+	mountedDiskState = state;
 	cwd = ROOT_DIR;
 
-	strcpy(diskName, new_disk_name);
-	//Transfer the contents from the temporary super block to the global super block
-	//structure
+	snprintf(diskName, sizeof(diskName), "%s", new_disk_name);
+	//Transfer the validated superblock to the global super block structure.
+	//It is unchanged, so there is nothing to write back to the disk.
 	memcpy(superBlock, temp_superBlock, sizeof(Superblock));
-	memset(temp_superBlock, 0, sizeof(Superblock));
-	free(temp_superBlock);
-	writeSuperBlock();
-
+	releaseTempSuperBlock(direct);
+	inodeTableLoad(&inodeTable, superBlock);
+	memcpy(blockMap, newMap, sizeof(blockMap));
+	memcpy(savedMap, newMap, sizeof(savedMap));
+	strcpy(blockMapName, newMapName);
+	blockMapUsed = 1 == mapState;
+	blockMapOnFile = 1 == mapState;
+	countBlockRefs();
+	resetDiskCounters();
+
+	//free blocks of a consistent disk are empty
+	if(lazyZero)
+	{
+		for(int i = 0; i < FREE_SPACE_SIZE; i++)
+			zeroBlockList[i] = ~superBlock->free_block_list[i];
+		memset(pendingZeroList, 0, FREE_SPACE_SIZE);
+	}
 }
 
-int main(int argc, char **argv)
+//Copy the path argument starting at line[i] up to one of the characters in
+//stop or the end of the line. Returns the index where it stopped.
+int copyPathArg(char *line, int i, char *path, char *stop)
 {
-	if (2 != argc)
-	{
-		fprintf(stderr,"Usage: %s <input_file>\n",argv[0]);
-		return 1;
-	}
+	int len = 0;
+
+	while(line[i] != '\0' && NULL == strchr(stop, line[i]) && len < PATH_MAX_LEN - 1)
+		path[len++] = line[i++];
+	path[len] = '\0';
 
-	FILE *inputFile = fopen(argv[1], "r");
+	return i;
+}
+
+//Every component of a path has to be a valid name of at most 5 characters.
+//The root directory itself is only accepted where allowRoot is set.
+bool validPath(char *path, bool allowRoot)
+{
+	if(allowRoot && 0 == strcmp(path, "/"))
+		return true;
 
-	if (NULL == inputFile)
+	int len = 0;
+	for(char *c = ('/' == path[0]) ? path + 1 : path; ; c++)
 	{
-		perror("Error in opening the input file");
-		return 1;
+		if('/' == *c || '\0' == *c)
+		{
+			if(0 == len)
+				return false;
+			if('\0' == *c)
+				return true;
+			len = 0;
+		}
+		else if(5 < ++len)
+			return false;
 	}
+}
 
+//Run the commands in inputFile. lineNum counts the commands run so far and is
+//used in command errors together with inputName.
+void runCommands(FILE *inputFile, char *inputName, int *lineNum)
+{
 	char command;
 	char line[1024];
-	char num[3];
-	char arg1[5] = {'\0'};
+	char num[4];
+	char path[PATH_MAX_LEN] = {'\0'};
 	int arg2;
-	int lineNum = 0;
-
-	superBlock = (Superblock*) malloc (sizeof(Superblock));
-	memset(superBlock, 0, sizeof(Superblock));
-
-	memset(diskName, '\0', sizeof(diskName));
 
 	while(!feof(inputFile))
 	{
-		//lineNum++;
+		//(*lineNum)++;
 		int readArgs = fscanf(inputFile," %c", &command);
 
 		//precaution to skip empty line in the input file, if any!
@@ -826,39 +2155,40 @@ int main(int argc, char **argv)
 			continue;
 		}
 		
-		lineNum++;
+		(*lineNum)++;
+		traceSetCommand(*lineNum);
 
-		memset(arg1, '\0', sizeof(arg1));
+		memset(path, '\0', sizeof(path));
 		memset(line, '\0', sizeof(line));
 		memset(num, '\0', sizeof(num));
 		arg2 = 0;
 
+		commandWaiting++;
+		pthread_mutex_lock(&fsLock);
+		while(compactorTurn)
+			pthread_cond_wait(&commandTurn, &fsLock);
+		commandWaiting--;
+
 		switch(command)
 		{
 			case 'M':
-				if(1 != fscanf(inputFile," %s", arg1))
+				if(1 != fscanf(inputFile," %255s", path))
 				{
-					fprintf(stderr, "Command Error: %s, %d\n", argv[1], lineNum);
+					fprintf(stderr, "Command Error: %s, %d\n", inputName, *lineNum);
 				}
 				else
-					fs_mount(arg1);
+					fs_mount(path);
 				break;
 			case 'C':
 				if(fgets(line, sizeof(line), inputFile) == NULL || line[0] == '\n')
-					fprintf(stderr,"Command Error: %s, %d\n",argv[1], lineNum);
+					fprintf(stderr,"Command Error: %s, %d\n",inputName, *lineNum);
 				else
 				{
-					int i = 1;
-					for(; i < 6; i++)
-					{
-						if(line[i] == ' ')
-							break;
-						arg1[i-1] = line[i];
-					}
+					int i = copyPathArg(line, 1, path, " \n");
 
-					if(line[i] != ' ')
+					if(line[i] != ' ' || !validPath(path, false))
 					{
-                        fprintf(stderr, "Command Error: %s, %d\n", argv[1], lineNum);
+                        fprintf(stderr, "Command Error: %s, %d\n", inputName, *lineNum);
                         break;
                     }
 
@@ -875,53 +2205,48 @@ int main(int argc, char **argv)
 
 					if(arg2 > 127)
 					{
-						fprintf(stderr,"Command Error: %s, %d\n", argv[1], lineNum);
+						fprintf(stderr,"Command Error: %s, %d\n", inputName, *lineNum);
 						break;
 					}
 
-					fs_create(arg1, arg2);
+					fs_create(path, arg2);
 				}
 				break;
 			case 'D':
 				if (fgets(line, sizeof(line), inputFile) == NULL || line[0] == '\n')
-					fprintf(stderr, "Command Error: %s, %d\n", argv[1], lineNum);
+					fprintf(stderr, "Command Error: %s, %d\n", inputName, *lineNum);
 				else
 				{
-					int i = 1;
-					for(; i < 6; i++)
-					{
-						if('\n' == line[i])
-							break;
-						arg1[i-1] = line[i];
-					}
-					if('\n' != line[i])
-						fprintf(stderr, "Command Error: %s, %d\n", argv[1], lineNum);
+					int i = copyPathArg(line, 1, path, "\n");
+
+					if('\n' != line[i] || !validPath(path, false))
+						fprintf(stderr, "Command Error: %s, %d\n", inputName, *lineNum);
 					else
-						fs_delete(arg1, cwd);
+						fs_delete(path, cwd);
 				}
                 break;
 			case 'R':
-				if(2 != fscanf(inputFile," %s %d",arg1, &arg2))
+				if(2 != fscanf(inputFile," %255s %d",path, &arg2) || !validPath(path, false))
 				{
-					fprintf(stderr, "Command Error: %s, %d\n", argv[1], lineNum);
+					fprintf(stderr, "Command Error: %s, %d\n", inputName, *lineNum);
 				}
 				else
-					fs_read(arg1,arg2);
+					fs_read(path,arg2);
 				break;
 			case 'W':
-				if(2 != fscanf(inputFile," %s %d",arg1, &arg2))
+				if(2 != fscanf(inputFile," %255s %d",path, &arg2) || !validPath(path, false))
 				{
-					fprintf(stderr, "Command Error: %s, %d\n", argv[1], lineNum);
+					fprintf(stderr, "Command Error: %s, %d\n", inputName, *lineNum);
 				}
 				else
 				{		
-					fs_write(arg1, arg2);
+					fs_write(path, arg2);
 				}
 				break;
 			case 'B':
 				if (fgets(line, sizeof(line), inputFile) == NULL || line[0] == '\n') 
 				{
-					fprintf(stderr, "Command Error: %s, %d\n", argv[1], lineNum);
+					fprintf(stderr, "Command Error: %s, %d\n", inputName, *lineNum);
 				}
 				else 
 				{
@@ -931,7 +2256,7 @@ int main(int argc, char **argv)
 					{
 						if(' ' == line[i])
 						{
-							fprintf(stderr, "Command Error: %s, %d\n", argv[1], lineNum);
+							fprintf(stderr, "Command Error: %s, %d\n", inputName, *lineNum);
 							break;
 						}
 
@@ -947,28 +2272,22 @@ int main(int argc, char **argv)
 			case 'L':
 				if(0 < fscanf(inputFile," %d", &arg2))
 				{
-					fprintf(stderr, "Command Error: %s, %d\n", argv[1], lineNum);
+					fprintf(stderr, "Command Error: %s, %d\n", inputName, *lineNum);
                 }
 				else
 					fs_ls();
 				break;
 			case 'E':
 				if(fgets(line, sizeof(line), inputFile) == NULL || line[0] == '\n')
-					fprintf(stderr, "Command Error: %s, %d\n", argv[1], lineNum);
+					fprintf(stderr, "Command Error: %s, %d\n", inputName, *lineNum);
 				else
 				{
 					{
-						int i =	1;
-						for(; i < 6; i++)
-						{
-							if(' ' == line[i])
-								break;
-							arg1[i-1] = line[i];
-						}
+						int i =	copyPathArg(line, 1, path, " \n");
 						
-						if(line[i] != ' ')
+						if(line[i] != ' ' || !validPath(path, false))
 						{
-							fprintf(stderr, "Command Error: %s, %d\n", argv[1], lineNum);
+							fprintf(stderr, "Command Error: %s, %d\n", inputName, *lineNum);
 							break;
 						}
 
@@ -983,42 +2302,191 @@ int main(int argc, char **argv)
 
 
 						arg2 = atoi(num);
-						fs_resize(arg1, arg2);
+						fs_resize(path, arg2);
 					}
 				}
 				break;
 			case 'O':
 				fs_defrag();
 				break;
+			case 'F':
+				fs_frag();
+				break;
+			case 'I':
+				if(1 != fscanf(inputFile," %255s", path))
+					fprintf(stderr, "Command Error: %s, %d\n", inputName, *lineNum);
+				else
+					fs_import(path);
+				break;
+			case 'X':
+				if(1 != fscanf(inputFile," %255s", path))
+					fprintf(stderr, "Command Error: %s, %d\n", inputName, *lineNum);
+				else
+					fs_export(path);
+				break;
 			case 'Y':
                 if (fgets(line, sizeof(line), inputFile) == NULL || line[0] == '\n') 
-                    fprintf(stderr, "Command Error: %s, %d\n", argv[1], lineNum);
+                    fprintf(stderr, "Command Error: %s, %d\n", inputName, *lineNum);
 				else 
 				{
-					int i = 1;
-					for(; i < 6; i++)
-					{
-						if(' ' == line[i] || '\n' == line[i])
-							break;
-						arg1[i-1] = line[i];
-					}
+					int i = copyPathArg(line, 1, path, " \n");
 
-					if(line[i] != '\n')
+					if(line[i] != '\n' || !validPath(path, true))
 					{
-						fprintf(stderr, "Command Error: %s, %d\n", argv[1], lineNum);
+						fprintf(stderr, "Command Error: %s, %d\n", inputName, *lineNum);
 						break;
 					}
-					fs_cd(arg1);
+					fs_cd(path);
                 }
 				break;
 			default:
-				fprintf(stderr, "Command Error: %s, %d\n", argv[1], lineNum);
+				fprintf(stderr, "Command Error: %s, %d\n", inputName, *lineNum);
 				fscanf(inputFile, "%*[^\n]");
 				break;
 			}
+
+		//the block writes of a command go to the engine together
+		aioSubmit();
+
+		if(compactorEnabled)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &lastCommand);
+			compactorTurn = true;
+			pthread_cond_signal(&compactorWake);
+		}
+		pthread_mutex_unlock(&fsLock);
+		}
+}
+
+void usage(char *prog)
+{
+	fprintf(stderr,"Usage: %s [-z] [-d] [-C] [-u] [-a sync|uring|threads] [-t trace_file] [-b percent] <input_file>\n", prog);
+	fprintf(stderr,"       %s [-z] [-d] [-C] [-u] [-a sync|uring|threads] [-t trace_file] [-b percent] -s socket_path\n", prog);
+	fprintf(stderr,"       %s -c socket_path <input_file>\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	AioBackend backend = AIO_SYNC;
+	char *traceName = NULL;
+	char *socketPath = NULL;
+	char *serverPath = NULL;
+	while(-1 != (opt = getopt(argc, argv, "zdCua:t:s:c:b:")))
+	{
+		switch(opt)
+		{
+			case 'z':
+				lazyZero = true;
+				break;
+			case 'd':
+				directIO = true;
+				break;
+			case 'C':
+				compressBlocks = true;
+				break;
+			case 'u':
+				dedupBlocks = true;
+				break;
+			case 't':
+				traceName = optarg;
+				break;
+			case 's':
+				socketPath = optarg;
+				break;
+			case 'c':
+				serverPath = optarg;
+				break;
+			case 'b':
+				compactThreshold = atoi(optarg);
+				if(compactThreshold < 0 || compactThreshold > 100)
+				{
+					fprintf(stderr,"Error: Compaction threshold %s is not a percentage\n", optarg);
+					return 1;
+				}
+				compactorEnabled = true;
+				break;
+			case 'a':
+				if(0 == strcmp(optarg, "sync"))
+					backend = AIO_SYNC;
+				else if(0 == strcmp(optarg, "uring"))
+					backend = AIO_URING;
+				else if(0 == strcmp(optarg, "threads"))
+					backend = AIO_THREADS;
+				else
+				{
+					fprintf(stderr,"Error: Unknown I/O engine %s\n", optarg);
+					return 1;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
 		}
+	}
 
-		free(superBlock);
+	//a server takes its commands from the socket, everything else from a file
+	if (optind + (NULL == socketPath) != argc || (NULL != socketPath && NULL != serverPath))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	char *inputName = argv[optind];
+	FILE *inputFile = NULL;
+
+	if (NULL == socketPath && NULL == (inputFile = fopen(inputName, "r")))
+	{
+		perror("Error in opening the input file");
+		return 1;
+	}
+
+	if(NULL != serverPath)
+	{
+		int status = clientRun(serverPath, inputFile);
+		fclose(inputFile);
+		return (0 == status) ? 0 : 1;
+	}
+
+	if(NULL != traceName && 0 != traceOpen(traceName))
+	{
+		perror("Error in opening the trace file");
+		return 1;
+	}
+
+	int lineNum = 0;
+	int status = 0;
+
+	//aligned so that it can be written to the disk directly with O_DIRECT
+	if(0 != posix_memalign((void **) &superBlock, DIRECT_IO_ALIGN, sizeof(Superblock)))
+	{
+		fprintf(stderr,"Error: Cannot allocate the superblock\n");
+		return 1;
+	}
+	memset(superBlock, 0, sizeof(Superblock));
+	inodeTableLoad(&inodeTable, superBlock);
+
+	aioInit(backend);
+
+	memset(diskName, '\0', sizeof(diskName));
+
+	if(compactorEnabled)
+		startCompactor();
+
+	if(NULL != socketPath)
+	{
+		if(0 != serverRun(socketPath, runCommands))
+			status = 1;
+	}
+	else
+		runCommands(inputFile, inputName, &lineNum);
+
+	stopCompactor();
+	unmountDisk();
+	aioShutdown();
+	traceClose();
+	free(superBlock);
+	if(NULL != inputFile)
 		fclose(inputFile);
-		return 0;
+	return status;
 }
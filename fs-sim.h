@@ -1,3 +1,10 @@
+#define FREE_SPACE_SIZE		16 //bytes
+#define INODE_COUNT			126
+#define INODE_LIST_SIZE		sizeof(Inode) * INODE_COUNT
+#define ROOT_DIR			127
+#define DATA_BLOCK_COUNT	127
+#define DATA_BLOCK_SIZE		1024
+
 typedef struct {
 	char name[5];        // Name of the file/directory (not necessarily null terminated)
 	uint8_t used_size;   // State of inode and size of the file/directory
@@ -19,4 +26,7 @@ void fs_buff(char buff[1024]);
 void fs_ls(void);
 void fs_resize(char name[5], int new_size);
 void fs_defrag(void);
+void fs_frag(void);
+void fs_import(char *hostPath);
+void fs_export(char *hostPath);
 void fs_cd(char name[5]);
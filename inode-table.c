@@ -0,0 +1,252 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "fs-sim.h"
+#include "inode-table.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+typedef void (*ByteMatchFn)(uint8_t *bytes, uint8_t mask, uint8_t value, InodeSet *out);
+typedef void (*NameMatchFn)(uint64_t *names, uint64_t key, InodeSet *out);
+
+//Pack a name into a 64-bit key. Names compare like strncmp(a, b, 5), so
+//anything after the first NUL is ignored.
+static uint64_t nameKey(char name[5])
+{
+	uint64_t key = 0;
+
+	for(int i = 0; i < 5 && name[i] != '\0'; i++)
+		key |= (uint64_t) (uint8_t) name[i] << (8 * i);
+
+	return key;
+}
+
+static void byteMatchScalar(uint8_t *bytes, uint8_t mask, uint8_t value, InodeSet *out)
+{
+	out->bits[0] = out->bits[1] = 0;
+
+	for(int i = 0; i < INODE_TABLE_SLOTS; i++)
+	{
+		if((bytes[i] & mask) == value)
+			out->bits[i / 64] |= (uint64_t) 1 << (i % 64);
+	}
+}
+
+static void nameMatchScalar(uint64_t *names, uint64_t key, InodeSet *out)
+{
+	out->bits[0] = out->bits[1] = 0;
+
+	for(int i = 0; i < INODE_TABLE_SLOTS; i++)
+	{
+		if(names[i] == key)
+			out->bits[i / 64] |= (uint64_t) 1 << (i % 64);
+	}
+}
+
+#if defined(__x86_64__)
+//SSE2 is part of x86-64, so these need no runtime check
+static void byteMatchSse2(uint8_t *bytes, uint8_t mask, uint8_t value, InodeSet *out)
+{
+	__m128i vmask = _mm_set1_epi8(mask);
+	__m128i vvalue = _mm_set1_epi8(value);
+
+	out->bits[0] = out->bits[1] = 0;
+
+	for(int i = 0; i < INODE_TABLE_SLOTS; i += 16)
+	{
+		__m128i v = _mm_and_si128(_mm_loadu_si128((__m128i *) (bytes + i)), vmask);
+		uint64_t hits = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, vvalue));
+		out->bits[i / 64] |= hits << (i % 64);
+	}
+}
+
+static void nameMatchSse2(uint64_t *names, uint64_t key, InodeSet *out)
+{
+	__m128i vkey = _mm_set1_epi64x(key);
+
+	out->bits[0] = out->bits[1] = 0;
+
+	for(int i = 0; i < INODE_TABLE_SLOTS; i += 2)
+	{
+		//no 64-bit compare in SSE2: both 32-bit halves have to match
+		__m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((__m128i *) (names + i)), vkey);
+		eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+		uint64_t hits = _mm_movemask_pd(_mm_castsi128_pd(eq));
+		out->bits[i / 64] |= hits << (i % 64);
+	}
+}
+
+__attribute__((target("avx2")))
+static void byteMatchAvx2(uint8_t *bytes, uint8_t mask, uint8_t value, InodeSet *out)
+{
+	__m256i vmask = _mm256_set1_epi8(mask);
+	__m256i vvalue = _mm256_set1_epi8(value);
+
+	out->bits[0] = out->bits[1] = 0;
+
+	for(int i = 0; i < INODE_TABLE_SLOTS; i += 32)
+	{
+		__m256i v = _mm256_and_si256(_mm256_loadu_si256((__m256i *) (bytes + i)), vmask);
+		uint64_t hits = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vvalue));
+		out->bits[i / 64] |= hits << (i % 64);
+	}
+}
+
+__attribute__((target("avx2")))
+static void nameMatchAvx2(uint64_t *names, uint64_t key, InodeSet *out)
+{
+	__m256i vkey = _mm256_set1_epi64x(key);
+
+	out->bits[0] = out->bits[1] = 0;
+
+	for(int i = 0; i < INODE_TABLE_SLOTS; i += 4)
+	{
+		__m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((__m256i *) (names + i)), vkey);
+		uint64_t hits = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+		out->bits[i / 64] |= hits << (i % 64);
+	}
+}
+#endif
+
+static ByteMatchFn byteMatch = NULL;
+static NameMatchFn nameMatch = NULL;
+
+static void pickKernels(void)
+{
+	byteMatch = byteMatchScalar;
+	nameMatch = nameMatchScalar;
+
+#if defined(__x86_64__)
+	byteMatch = byteMatchSse2;
+	nameMatch = nameMatchSse2;
+
+	if(__builtin_cpu_supports("avx2"))
+	{
+		byteMatch = byteMatchAvx2;
+		nameMatch = nameMatchAvx2;
+	}
+#endif
+}
+
+static void intersect(InodeSet *a, InodeSet *b)
+{
+	a->bits[0] &= b->bits[0];
+	a->bits[1] &= b->bits[1];
+}
+
+static Dentry *dentrySlot(InodeTable *table, uint8_t parent, uint64_t key)
+{
+	uint64_t hash = (key ^ ((uint64_t) parent << 40)) * 0x9E3779B97F4A7C15ULL;
+	return &table->dentries[hash >> 56 & (DENTRY_CACHE_SIZE - 1)];
+}
+
+static void dentryInvalidate(InodeTable *table, uint8_t parent, uint64_t key)
+{
+	Dentry *dentry = dentrySlot(table, parent, key);
+	if(dentry->valid && dentry->parent == parent && dentry->name == key)
+		dentry->valid = false;
+}
+
+void inodeTableSet(InodeTable *table, int idx, Inode *inode)
+{
+	//Lookups of both the old and the new (parent, name) may now have a
+	//different answer
+	dentryInvalidate(table, table->dirParent[idx] & 0x7F, table->name[idx]);
+	dentryInvalidate(table, inode->dir_parent & 0x7F, nameKey(inode->name));
+
+	table->name[idx] = nameKey(inode->name);
+	table->used[idx] = (inode->used_size & 0x80) ? 1 : 0;
+	table->dirParent[idx] = inode->dir_parent;
+	table->start[idx] = inode->start_block;
+	table->size[idx] = inode->used_size & 0x7F;
+}
+
+void inodeTableLoad(InodeTable *table, Superblock *sb)
+{
+	if(NULL == byteMatch)
+		pickKernels();
+
+	memset(table, 0, sizeof(InodeTable));
+
+	for(int i = 0; i < INODE_COUNT; i++)
+		inodeTableSet(table, i, &sb->inode[i]);
+
+	//padding slots never match a parent or a start block lookup
+	for(int i = INODE_COUNT; i < INODE_TABLE_SLOTS; i++)
+	{
+		table->used[i] = 1;
+		table->dirParent[i] = 0xFF;
+		table->start[i] = 0xFF;
+	}
+}
+
+int inodeTableFirstFree(InodeTable *table)
+{
+	InodeSet free;
+	byteMatch(table->used, 0xFF, 0, &free);
+	return inodeSetNext(&free, 0);
+}
+
+void inodeTableChildren(InodeTable *table, uint8_t parent, uint8_t parentMask, InodeSet *out)
+{
+	InodeSet used;
+	byteMatch(table->dirParent, parentMask, parent, out);
+	byteMatch(table->used, 0xFF, 1, &used);
+	intersect(out, &used);
+
+	//padding slots look used, keep them out
+	out->bits[1] &= ((uint64_t) 1 << (INODE_COUNT - 64)) - 1;
+}
+
+int inodeTableFind(InodeTable *table, char name[5], uint8_t parent, uint8_t parentMask)
+{
+	InodeSet matches, names;
+	inodeTableChildren(table, parent, parentMask, &matches);
+	nameMatch(table->name, nameKey(name), &names);
+	intersect(&matches, &names);
+	return inodeSetNext(&matches, 0);
+}
+
+int inodeTableLookup(InodeTable *table, char name[5], uint8_t parent)
+{
+	uint64_t key = nameKey(name);
+	Dentry *dentry = dentrySlot(table, parent, key);
+
+	if(dentry->valid && dentry->parent == parent && dentry->name == key)
+		return dentry->inode;
+
+	dentry->name = key;
+	dentry->parent = parent;
+	dentry->inode = inodeTableFind(table, name, parent, 0x7F);
+	dentry->valid = true;
+	return dentry->inode;
+}
+
+int inodeTableFindStart(InodeTable *table, uint8_t start)
+{
+	InodeSet matches;
+	byteMatch(table->start, 0xFF, start, &matches);
+	matches.bits[1] &= ((uint64_t) 1 << (INODE_COUNT - 64)) - 1;
+	return inodeSetNext(&matches, 0);
+}
+
+int inodeSetCount(InodeSet *set)
+{
+	return __builtin_popcountll(set->bits[0]) + __builtin_popcountll(set->bits[1]);
+}
+
+int inodeSetNext(InodeSet *set, int idx)
+{
+	for(int word = idx / 64; word < 2; word++)
+	{
+		uint64_t bits = set->bits[word];
+		if(word == idx / 64)
+			bits &= ~(uint64_t) 0 << (idx % 64);
+		if(bits)
+			return word * 64 + __builtin_ctzll(bits);
+	}
+	return -1;
+}
@@ -0,0 +1,46 @@
+//In-memory struct-of-arrays copy of the inode list. It mirrors the Superblock
+//and lets lookups over all inodes run as SIMD scans. Include after fs-sim.h.
+
+#define INODE_TABLE_SLOTS	128 //126 inodes padded to a multiple of the vector width
+#define DENTRY_CACHE_SIZE	256 //must be a power of two
+
+//Cached result of looking a name up in a directory
+typedef struct {
+	uint64_t name;
+	uint8_t parent;
+	int8_t inode;  // -1 caches a miss
+	bool valid;
+} Dentry;
+
+typedef struct {
+	uint64_t name[INODE_TABLE_SLOTS];     // name up to the first NUL, zero padded
+	uint8_t used[INODE_TABLE_SLOTS];      // 1 if the inode is in use
+	uint8_t dirParent[INODE_TABLE_SLOTS]; // raw dir_parent byte (type bit and parent)
+	uint8_t start[INODE_TABLE_SLOTS];     // start_block
+	uint8_t size[INODE_TABLE_SLOTS];      // used_size without the state bit
+	Dentry dentries[DENTRY_CACHE_SIZE];   // (parent, name) -> inode
+} InodeTable;
+
+//One bit per inode index
+typedef struct {
+	uint64_t bits[2];
+} InodeSet;
+
+void inodeTableLoad(InodeTable *table, Superblock *sb);
+void inodeTableSet(InodeTable *table, int idx, Inode *inode);
+
+//first free inode, or -1 if every inode is in use
+int inodeTableFirstFree(InodeTable *table);
+//used inodes whose (dir_parent & parentMask) equals parent
+void inodeTableChildren(InodeTable *table, uint8_t parent, uint8_t parentMask, InodeSet *out);
+//first used inode called name whose (dir_parent & parentMask) equals parent, or -1
+int inodeTableFind(InodeTable *table, char name[5], uint8_t parent, uint8_t parentMask);
+//same as inodeTableFind(table, name, parent, 0x7F) but served from the
+//dentry cache when possible
+int inodeTableLookup(InodeTable *table, char name[5], uint8_t parent);
+//first inode (used or not) whose start_block is start, or -1
+int inodeTableFindStart(InodeTable *table, uint8_t start);
+
+int inodeSetCount(InodeSet *set);
+//next member at or after idx, or -1
+int inodeSetNext(InodeSet *set, int idx);
@@ -0,0 +1,164 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH	4
+#define LZ_HASH_BITS	10
+#define LZ_MAX_OFFSET	65535
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static int hash32(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+//Length byte run used when a count does not fit its 4 bits. Returns the
+//new output position, or NULL if it would pass end.
+static uint8_t *putLength(uint8_t *op, uint8_t *end, int n)
+{
+	for(; n >= 255; n -= 255)
+	{
+		if(op >= end)
+			return NULL;
+		*op++ = 255;
+	}
+	if(op >= end)
+		return NULL;
+	*op++ = n;
+	return op;
+}
+
+static uint8_t *putSequence(uint8_t *op, uint8_t *end, const uint8_t *literals, int litLen, int offset, int matchLen)
+{
+	if(op >= end)
+		return NULL;
+
+	int matchCode = matchLen ? matchLen - LZ_MIN_MATCH : 0;
+	*op++ = ((litLen < 15 ? litLen : 15) << 4) | (matchCode < 15 ? matchCode : 15);
+
+	if(litLen >= 15 && NULL == (op = putLength(op, end, litLen - 15)))
+		return NULL;
+
+	if(end - op < litLen)
+		return NULL;
+	memcpy(op, literals, litLen);
+	op += litLen;
+
+	if(0 == matchLen)
+		return op;
+
+	if(end - op < 2)
+		return NULL;
+	*op++ = offset & 0xFF;
+	*op++ = offset >> 8;
+
+	if(matchCode >= 15 && NULL == (op = putLength(op, end, matchCode - 15)))
+		return NULL;
+	return op;
+}
+
+int lzCompress(const uint8_t *src, int len, uint8_t *dst, int cap)
+{
+	int table[1 << LZ_HASH_BITS];
+	uint8_t *op = dst;
+	uint8_t *end = dst + cap;
+	int anchor = 0;
+
+	for(int i = 0; i < (1 << LZ_HASH_BITS); i++)
+		table[i] = -1;
+
+	int i = 0;
+	while(i + LZ_MIN_MATCH <= len)
+	{
+		uint32_t v = read32(src + i);
+		int h = hash32(v);
+		int candidate = table[h];
+		table[h] = i;
+
+		if(-1 == candidate || i - candidate > LZ_MAX_OFFSET || read32(src + candidate) != v)
+		{
+			i++;
+			continue;
+		}
+
+		int matchLen = LZ_MIN_MATCH;
+		while(i + matchLen < len && src[candidate + matchLen] == src[i + matchLen])
+			matchLen++;
+
+		op = putSequence(op, end, src + anchor, i - anchor, i - candidate, matchLen);
+		if(NULL == op)
+			return -1;
+
+		i += matchLen;
+		anchor = i;
+	}
+
+	op = putSequence(op, end, src + anchor, len - anchor, 0, 0);
+	return (NULL == op) ? -1 : (int) (op - dst);
+}
+
+//Read the length bytes following a count of 15
+static const uint8_t *getLength(const uint8_t *ip, const uint8_t *end, int *n)
+{
+	uint8_t b;
+	do
+	{
+		if(ip >= end)
+			return NULL;
+		b = *ip++;
+		*n += b;
+	} while(255 == b);
+	return ip;
+}
+
+int lzDecompress(const uint8_t *src, int len, uint8_t *dst, int cap)
+{
+	const uint8_t *ip = src;
+	const uint8_t *end = src + len;
+	int out = 0;
+
+	while(ip < end)
+	{
+		uint8_t token = *ip++;
+		int litLen = token >> 4;
+
+		if(15 == litLen && NULL == (ip = getLength(ip, end, &litLen)))
+			return -1;
+		if(end - ip < litLen || cap - out < litLen)
+			return -1;
+
+		memcpy(dst + out, ip, litLen);
+		ip += litLen;
+		out += litLen;
+
+		//the last sequence has no match
+		if(ip == end)
+			break;
+
+		if(end - ip < 2)
+			return -1;
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		int matchLen = token & 0x0F;
+		if(15 == matchLen && NULL == (ip = getLength(ip, end, &matchLen)))
+			return -1;
+		matchLen += LZ_MIN_MATCH;
+
+		if(0 == offset || offset > out || cap - out < matchLen)
+			return -1;
+
+		//byte by byte, a match may overlap the bytes it produces
+		for(int k = 0; k < matchLen; k++, out++)
+			dst[out] = dst[out - offset];
+	}
+
+	return out;
+}
@@ -0,0 +1,11 @@
+//Small LZ77 block codec in the LZ4 style: a sequence is a token byte holding
+//the literal count and match length, the literals, and a 16-bit match
+//offset. The last sequence has literals only.
+
+//Compress len bytes of src into dst. Returns the compressed length, or -1
+//if it does not fit in cap bytes.
+int lzCompress(const uint8_t *src, int len, uint8_t *dst, int cap);
+
+//Decompress len bytes of src into dst. Returns the decompressed length, or
+//-1 if src is malformed or the output does not fit in cap bytes.
+int lzDecompress(const uint8_t *src, int len, uint8_t *dst, int cap);
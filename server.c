@@ -0,0 +1,442 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "server.h"
+
+#define SERVER_MAX_CLIENTS	64
+#define SERVER_READ_SIZE	65536
+#define SERVER_LINE_LIMIT	(1 << 20) //longest line a client may send
+#define SERVER_OUT_LIMIT	(1 << 20) //stop reading while this much is unsent
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t cap;
+} ByteBuffer;
+
+typedef struct {
+	int fd;
+	bool readDone;     // client shut down its side, no more lines follow
+	int lineNum;
+	ByteBuffer in;     // received bytes not yet run
+	ByteBuffer out;    // replies not yet sent
+	size_t sent;       // bytes of out already sent
+} Client;
+
+static volatile sig_atomic_t serverStop = 0;
+static Client clients[SERVER_MAX_CLIENTS];
+static int clientCount = 0;
+
+//Command output is captured in two memory files standing in for
+//stdout and stderr while a line runs.
+static int captureOut = -1;
+static int captureErr = -1;
+static FILE *serverLog = NULL;
+
+static void stopHandler(int sig)
+{
+	(void) sig;
+	serverStop = 1;
+}
+
+static int bufferReserve(ByteBuffer *buffer, size_t len)
+{
+	if(buffer->len + len <= buffer->cap)
+		return 0;
+
+	size_t cap = buffer->cap ? buffer->cap : 4096;
+	while(cap < buffer->len + len)
+		cap *= 2;
+
+	char *grown = realloc(buffer->data, cap);
+	if(NULL == grown)
+		return -1;
+	buffer->data = grown;
+	buffer->cap = cap;
+	return 0;
+}
+
+static int bufferAppend(ByteBuffer *buffer, const char *data, size_t len)
+{
+	if(0 != bufferReserve(buffer, len))
+		return -1;
+
+	memcpy(buffer->data + buffer->len, data, len);
+	buffer->len += len;
+	return 0;
+}
+
+static void bufferConsume(ByteBuffer *buffer, size_t len)
+{
+	memmove(buffer->data, buffer->data + len, buffer->len - len);
+	buffer->len -= len;
+}
+
+//Move what was written to a capture file into the reply, NUL terminated
+static int collectCapture(int fd, ByteBuffer *reply)
+{
+	off_t size = lseek(fd, 0, SEEK_CUR);
+
+	if(0 != bufferReserve(reply, size + 1))
+		return -1;
+	if(0 < size && size != pread(fd, reply->data + reply->len, size, 0))
+		return -1;
+	reply->len += size;
+	reply->data[reply->len++] = '\0';
+
+	if(0 != ftruncate(fd, 0) || -1 == lseek(fd, 0, SEEK_SET))
+		return -1;
+	return 0;
+}
+
+static int runLine(Client *client, char *line, size_t len, char *name, CommandRunner runner)
+{
+	FILE *input = fmemopen(line, len, "r");
+	if(NULL == input)
+		return -1;
+
+	runner(input, name, &client->lineNum);
+	fclose(input);
+	fflush(stdout);
+	fflush(stderr);
+
+	if(0 != collectCapture(captureOut, &client->out) || 0 != collectCapture(captureErr, &client->out))
+		return -1;
+	return 0;
+}
+
+//Run every complete line received from the client. Blank lines get no reply,
+//as they are skipped in input files too.
+static int runLines(Client *client, char *name, CommandRunner runner)
+{
+	size_t done = 0;
+
+	while(done < client->in.len)
+	{
+		char *line = client->in.data + done;
+		char *newline = memchr(line, '\n', client->in.len - done);
+		size_t len;
+
+		if(NULL != newline)
+			len = newline - line + 1;
+		else if(client->readDone)
+			len = client->in.len - done; //last line without a newline
+		else
+			break;
+
+		bool blank = true;
+		for(size_t i = 0; i < len && blank; i++)
+			blank = (NULL != strchr(" \t\r\n", line[i]));
+
+		if(!blank && 0 != runLine(client, line, len, name, runner))
+			return -1;
+		done += len;
+	}
+
+	bufferConsume(&client->in, done);
+	return 0;
+}
+
+static int sendReplies(Client *client)
+{
+	while(client->sent < client->out.len)
+	{
+		ssize_t sent = send(client->fd, client->out.data + client->sent, client->out.len - client->sent, MSG_NOSIGNAL);
+		if(-1 == sent)
+			return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+		client->sent += sent;
+	}
+
+	client->out.len = 0;
+	client->sent = 0;
+	return 0;
+}
+
+static void dropClient(int idx)
+{
+	close(clients[idx].fd);
+	free(clients[idx].in.data);
+	free(clients[idx].out.data);
+	clients[idx] = clients[--clientCount];
+}
+
+static int readClient(Client *client, char *name, CommandRunner runner)
+{
+	char chunk[SERVER_READ_SIZE];
+	ssize_t got = recv(client->fd, chunk, sizeof(chunk), 0);
+
+	if(-1 == got)
+		return (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno) ? 0 : -1;
+
+	if(0 == got)
+		client->readDone = true;
+	else if(0 != bufferAppend(&client->in, chunk, got) || client->in.len > SERVER_LINE_LIMIT)
+		return -1;
+
+	//all lines of this read are answered with one send
+	if(0 != runLines(client, name, runner))
+		return -1;
+	return sendReplies(client);
+}
+
+static int listenOn(char *socketPath)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if(strlen(socketPath) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr,"Error: Socket path %s is too long\n", socketPath);
+		return -1;
+	}
+	strcpy(addr.sun_path, socketPath);
+
+	//a socket left behind by an earlier server is replaced, anything else is kept
+	struct stat st;
+	if(0 == lstat(socketPath, &st) && S_ISSOCK(st.st_mode))
+		unlink(socketPath);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(-1 == fd)
+	{
+		perror("Error in creating the socket");
+		return -1;
+	}
+
+	if(0 != bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || 0 != listen(fd, SOMAXCONN))
+	{
+		perror("Error in binding the socket");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int serverRun(char *socketPath, CommandRunner runner)
+{
+	int listenFD = listenOn(socketPath);
+	if(-1 == listenFD)
+		return -1;
+
+	captureOut = memfd_create("fs-stdout", MFD_CLOEXEC);
+	captureErr = memfd_create("fs-stderr", MFD_CLOEXEC);
+	int savedOut = dup(STDOUT_FILENO);
+	int savedErr = dup(STDERR_FILENO);
+
+	if(-1 == captureOut || -1 == captureErr || -1 == savedOut || -1 == savedErr)
+	{
+		perror("Error in setting up the server");
+		close(listenFD);
+		unlink(socketPath);
+		return -1;
+	}
+
+	//the server's own messages still reach the original stderr
+	serverLog = fdopen(dup(savedErr), "w");
+	setvbuf(serverLog, NULL, _IONBF, 0);
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(captureOut, STDOUT_FILENO);
+	dup2(captureErr, STDERR_FILENO);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stopHandler;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	fprintf(serverLog, "Listening on %s\n", socketPath);
+
+	struct pollfd fds[SERVER_MAX_CLIENTS + 1];
+
+	while(!serverStop)
+	{
+		fds[0].fd = listenFD;
+		fds[0].events = (clientCount < SERVER_MAX_CLIENTS) ? POLLIN : 0;
+
+		for(int i = 0; i < clientCount; i++)
+		{
+			fds[i + 1].fd = clients[i].fd;
+			fds[i + 1].events = 0;
+			//a client that does not read its replies is not read from either
+			if(!clients[i].readDone && clients[i].out.len - clients[i].sent < SERVER_OUT_LIMIT)
+				fds[i + 1].events |= POLLIN;
+			if(clients[i].sent < clients[i].out.len)
+				fds[i + 1].events |= POLLOUT;
+		}
+
+		int count = clientCount;
+		if(-1 == poll(fds, count + 1, -1))
+		{
+			if(EINTR == errno)
+				continue;
+			fprintf(serverLog, "Error: poll failed: %s\n", strerror(errno));
+			break;
+		}
+
+		//walk backwards, dropping a client moves the last one into its slot
+		for(int i = count - 1; i >= 0; i--)
+		{
+			Client *client = &clients[i];
+			short revents = fds[i + 1].revents;
+			int status = 0;
+
+			if(revents & POLLOUT)
+				status = sendReplies(client);
+			if(0 == status && (revents & (POLLIN | POLLHUP | POLLERR)) && !client->readDone)
+				status = readClient(client, socketPath, runner);
+
+			if(0 != status || (client->readDone && client->sent == client->out.len))
+				dropClient(i);
+		}
+
+		if(fds[0].revents & POLLIN)
+		{
+			int fd = accept4(listenFD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if(-1 != fd)
+			{
+				memset(&clients[clientCount], 0, sizeof(Client));
+				clients[clientCount++].fd = fd;
+			}
+		}
+	}
+
+	while(0 < clientCount)
+		dropClient(clientCount - 1);
+	close(listenFD);
+	unlink(socketPath);
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(savedOut, STDOUT_FILENO);
+	dup2(savedErr, STDERR_FILENO);
+	close(savedOut);
+	close(savedErr);
+	close(captureOut);
+	close(captureErr);
+	fclose(serverLog);
+	return 0;
+}
+
+int clientRun(char *socketPath, FILE *input)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if(strlen(socketPath) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr,"Error: Socket path %s is too long\n", socketPath);
+		return -1;
+	}
+	strcpy(addr.sun_path, socketPath);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(-1 == fd || 0 != connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+	{
+		perror("Error in connecting to the server");
+		if(-1 != fd)
+			close(fd);
+		return -1;
+	}
+
+	//the whole script is sent without waiting for replies
+	ByteBuffer request = {NULL, 0, 0};
+	char chunk[SERVER_READ_SIZE];
+	size_t got;
+	while(0 < (got = fread(chunk, 1, sizeof(chunk), input)))
+	{
+		if(0 != bufferAppend(&request, chunk, got))
+		{
+			fprintf(stderr,"Error: Cannot buffer the input file\n");
+			free(request.data);
+			close(fd);
+			return -1;
+		}
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	size_t sent = 0;
+	bool writeDone = false;
+	bool stdoutField = true; // replies alternate between stdout and stderr
+	int status = 0;
+
+	if(0 == request.len)
+	{
+		shutdown(fd, SHUT_WR);
+		writeDone = true;
+	}
+
+	while(0 == status)
+	{
+		struct pollfd pfd = {fd, POLLIN | (writeDone ? 0 : POLLOUT), 0};
+		if(-1 == poll(&pfd, 1, -1))
+		{
+			if(EINTR == errno)
+				continue;
+			status = -1;
+			break;
+		}
+
+		if(!writeDone && (pfd.revents & POLLOUT))
+		{
+			ssize_t n = send(fd, request.data + sent, request.len - sent, MSG_NOSIGNAL);
+			if(-1 == n && EAGAIN != errno && EWOULDBLOCK != errno)
+				status = -1;
+			else if(0 < n && (sent += n) == request.len)
+			{
+				shutdown(fd, SHUT_WR);
+				writeDone = true;
+			}
+		}
+
+		if(pfd.revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+			if(0 == n)
+				break;
+			if(-1 == n)
+			{
+				if(EAGAIN != errno && EWOULDBLOCK != errno)
+					status = -1;
+				continue;
+			}
+
+			char *field = chunk;
+			char *end = chunk + n;
+			while(field < end)
+			{
+				char *nul = memchr(field, '\0', end - field);
+				size_t len = (NULL != nul) ? (size_t) (nul - field) : (size_t) (end - field);
+
+				fwrite(field, 1, len, stdoutField ? stdout : stderr);
+				if(NULL != nul)
+					stdoutField = !stdoutField;
+				field += len + (NULL != nul);
+			}
+		}
+	}
+
+	if(0 != status)
+		perror("Error in talking to the server");
+
+	free(request.data);
+	close(fd);
+	return status;
+}
@@ -0,0 +1,16 @@
+//Server mode. The simulator listens on a Unix domain socket and runs the
+//command lines sent by any number of local clients against one shared,
+//persistently mounted file system. Clients may send many lines without
+//waiting; each line is answered in order with its standard output and its
+//standard error, each terminated by a NUL byte. Replies to the lines that
+//arrive together are sent back together.
+
+//Runs the commands read from input. Errors name the input and the line.
+typedef void (*CommandRunner)(FILE *input, char *inputName, int *lineNum);
+
+//Serve until SIGINT or SIGTERM. Returns 0, or -1 if the socket cannot be set up.
+int serverRun(char *socketPath, CommandRunner runner);
+
+//Send the commands in input to a server and print the replies to
+//stdout and stderr. Returns 0, or -1 on a connection error.
+int clientRun(char *socketPath, FILE *input);
@@ -0,0 +1,56 @@
+#!/bin/sh
+#Run every tests/<category>/test<N>. A test runs fs on its cmd file in a copy
+#of its directory, with the options in its options file if it has one, and
+#passes when stdout and stderr match stdout_expected and stderr_expected and
+#every other <name>_expected file or directory matches <name>. A trace
+#written to trace is decoded with trace-dump into trace.txt first. A test
+#with a run script runs that instead of cmd, with the fs binary in $FS and
+#the fs-diff binary in $DIFF. The Codec time line of F differs from run to
+#run and is left out of stdout.
+#
+#usage: tests/run-tests.sh [fs_binary]
+
+cd "$(dirname "$0")" || exit 2
+fs=$(cd .. && pwd)/fs
+dump=$(cd .. && pwd)/trace-dump
+fsdiff=$(cd .. && pwd)/fs-diff
+[ -n "$1" ] && fs=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+
+pass=0
+fail=0
+for test in */test*
+do
+	work=$(mktemp -d) || exit 2
+	cp -R "$test"/. "$work"
+	options=
+	[ -f "$test/options" ] && options=$(cat "$test/options")
+
+	if [ -f "$test/run" ]
+	then
+		(cd "$work" && FS="$fs" DIFF="$fsdiff" timeout 60 sh run > stdout 2> stderr)
+	else
+		(cd "$work" && timeout 60 "$fs" $options cmd > stdout 2> stderr)
+	fi
+	grep -v '^Codec time ' "$work/stdout" > "$work/stdout.filtered"
+	mv "$work/stdout.filtered" "$work/stdout"
+	[ -f "$work/trace" ] && "$dump" "$work/trace" > "$work/trace.txt"
+
+	failed=
+	for expected in "$work"/*_expected
+	do
+		name=$(basename "$expected" _expected)
+		diff -r "$expected" "$work/$name" > /dev/null 2>&1 || failed="$failed $name"
+	done
+	rm -rf "$work"
+
+	if [ -z "$failed" ]
+	then
+		pass=$((pass + 1))
+	else
+		fail=$((fail + 1))
+		echo "FAIL $test:$failed"
+	fi
+done
+
+echo "$pass passed, $fail failed"
+[ 0 -eq "$fail" ]
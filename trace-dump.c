@@ -0,0 +1,61 @@
+//Print the records of a trace written with fs -t, one line per event:
+//the input line, the event, its source, the inode, the blocks and the free
+//block count after it.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+
+static const char *opNames[] = {"?", "alloc", "free", "move", "alloc-fail"};
+static const char *sourceNames[] = {"?", "create", "resize", "delete", "defrag", "compact", "import"};
+
+static const char *nameOf(const char **names, int count, int value)
+{
+	return (value > 0 && value < count) ? names[value] : names[0];
+}
+
+int main(int argc, char **argv)
+{
+	if(2 != argc)
+	{
+		fprintf(stderr,"Usage: %s trace_file\n", argv[0]);
+		return 2;
+	}
+
+	FILE *traceFile = fopen(argv[1], "rb");
+	if(NULL == traceFile)
+	{
+		fprintf(stderr,"Error: Cannot open %s\n", argv[1]);
+		return 2;
+	}
+
+	TraceHeader header;
+	if(1 != fread(&header, sizeof(header), 1, traceFile) || 0 != memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+			1 != header.version || sizeof(TraceRecord) != header.recordSize)
+	{
+		fprintf(stderr,"Error: %s is not a trace\n", argv[1]);
+		fclose(traceFile);
+		return 2;
+	}
+
+	TraceRecord record;
+	while(1 == fread(&record, sizeof(record), 1, traceFile))
+	{
+		printf("line %u %s %s inode %d", record.command, nameOf(opNames, 5, record.op),
+				nameOf(sourceNames, 7, record.source), record.inode);
+
+		if(TRACE_MOVE == record.op)
+			printf(" blocks %d-%d from %d", record.start, record.start + record.count - 1, record.from);
+		else if(TRACE_ALLOC_FAIL == record.op)
+			printf(" count %d", record.count);
+		else
+			printf(" blocks %d-%d", record.start, record.start + record.count - 1);
+
+		printf(" free %d\n", record.freeBlocks);
+	}
+
+	fclose(traceFile);
+	return 0;
+}
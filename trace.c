@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+
+static FILE *traceFile = NULL;
+static uint32_t traceCommand = 0;
+
+int traceOpen(char *fileName)
+{
+	traceFile = fopen(fileName, "wb");
+	if(NULL == traceFile)
+		return -1;
+
+	TraceHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = 1;
+	header.recordSize = sizeof(TraceRecord);
+
+	if(1 != fwrite(&header, sizeof(header), 1, traceFile))
+	{
+		fclose(traceFile);
+		traceFile = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void traceClose(void)
+{
+	if(NULL != traceFile)
+		fclose(traceFile);
+	traceFile = NULL;
+}
+
+void traceSetCommand(uint32_t command)
+{
+	traceCommand = command;
+}
+
+void traceEvent(TraceOp op, TraceSource source, int inode, int start, int from, int count, int freeBlocks)
+{
+	if(NULL == traceFile)
+		return;
+
+	TraceRecord record;
+	memset(&record, 0, sizeof(record));
+	record.command = traceCommand;
+	record.freeBlocks = freeBlocks;
+	record.op = op;
+	record.source = source;
+	record.inode = inode;
+	record.start = start;
+	record.from = from;
+	record.count = count;
+
+	fwrite(&record, sizeof(record), 1, traceFile);
+}
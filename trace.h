@@ -0,0 +1,42 @@
+//Binary trace of every block allocation, release and move. The file starts
+//with a TraceHeader followed by one TraceRecord per event, in host byte order.
+
+#define TRACE_MAGIC		"FSTRACE1"
+
+typedef enum {
+	TRACE_ALLOC = 1,      // blocks [start, start + count) allocated
+	TRACE_FREE = 2,       // blocks [start, start + count) released
+	TRACE_MOVE = 3,       // count blocks moved from from to start
+	TRACE_ALLOC_FAIL = 4  // no run of count free blocks was found
+} TraceOp;
+
+typedef enum {
+	TRACE_CREATE = 1,
+	TRACE_RESIZE = 2,
+	TRACE_DELETE = 3,
+	TRACE_DEFRAG = 4,
+	TRACE_COMPACT = 5, // background compactor
+	TRACE_IMPORT = 6   // bulk import of a host directory
+} TraceSource;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;    // 1
+	uint32_t recordSize; // sizeof(TraceRecord)
+} TraceHeader;
+
+typedef struct {
+	uint32_t command;   // line number of the command in the input file
+	uint16_t freeBlocks; // free data blocks after the event
+	uint8_t op;         // TraceOp
+	uint8_t source;     // TraceSource
+	uint8_t inode;
+	uint8_t start;
+	uint8_t from;       // source start block of a move, 0 otherwise
+	uint8_t count;
+} TraceRecord;
+
+int traceOpen(char *fileName);
+void traceClose(void);
+void traceSetCommand(uint32_t command);
+void traceEvent(TraceOp op, TraceSource source, int inode, int start, int from, int count, int freeBlocks);
@@ -0,0 +1,639 @@
+//Synthetic workload generator. Writes a command script in the simulator's
+//input syntax together with the starting disk image it mounts. The script is
+//produced from a small model of the disk (first fit allocation, the same
+//relocation and defrag rules as the simulator) so that commands target files
+//that exist and allocations that fit. The same seed always gives the same
+//script and image.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fs-sim.h"
+
+#define MAX_DIRS		63  //leave at least half of the inodes to files
+#define MAX_BUFFER_LEN	1000 //B lines must fit the simulator's line buffer
+
+typedef enum {
+	SIZE_FIXED,
+	SIZE_UNIFORM,
+	SIZE_GEOMETRIC
+} SizeModel;
+
+typedef struct {
+	char name[6];
+	bool used;
+	bool dir;
+	int parent; //node index, ROOT_DIR for the root
+	int start;
+	int size;
+} GenNode;
+
+//Operations the mix can pick from, in the order weights are listed
+static const char opLetters[] = "CDRWBELOY";
+int opWeights[sizeof(opLetters) - 1] = {30, 15, 20, 15, 5, 10, 2, 1, 2};
+
+GenNode nodes[INODE_COUNT];
+bool blockUsed[DATA_BLOCK_COUNT + 1];
+int dirList[MAX_DIRS + 1];
+int dirCount = 0;
+int fileCounter = 0;
+
+SizeModel sizeModel = SIZE_GEOMETRIC;
+int sizeA = 4;
+int sizeB = 0;
+
+uint64_t rngState;
+
+//splitmix64, so a seed gives the same output on every libc
+uint64_t nextRandom()
+{
+	uint64_t z = (rngState += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+//uniform in [0, n)
+int randomBelow(int n)
+{
+	return (int) (nextRandom() % (uint64_t) n);
+}
+
+double randomUnit()
+{
+	return (nextRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int randomSize()
+{
+	int size;
+
+	switch(sizeModel)
+	{
+		case SIZE_FIXED:
+			size = sizeA;
+			break;
+		case SIZE_UNIFORM:
+			size = sizeA + randomBelow(sizeB - sizeA + 1);
+			break;
+		default:
+			//number of trials up to the first success with p = 1/mean
+			size = 1;
+			while(size < DATA_BLOCK_COUNT && randomUnit() >= 1.0 / sizeA)
+				size++;
+			break;
+	}
+
+	if(size < 1)
+		size = 1;
+	if(size > DATA_BLOCK_COUNT - 1)
+		size = DATA_BLOCK_COUNT - 1;
+	return size;
+}
+
+int firstFreeNode()
+{
+	for(int i = 0; i < INODE_COUNT; i++)
+	{
+		if(!nodes[i].used)
+			return i;
+	}
+	return -1;
+}
+
+//First run of size free blocks, as fs_create searches
+int firstFit(int size)
+{
+	int run = 0;
+
+	for(int i = 1; i <= DATA_BLOCK_COUNT; i++)
+	{
+		run = blockUsed[i] ? 0 : run + 1;
+		if(run == size)
+			return i - size + 1;
+	}
+	return -1;
+}
+
+//Target fs_resize picks when a file cannot grow in place. Its search stops
+//before the last block.
+int relocateTarget(int size)
+{
+	int run = 0;
+
+	for(int i = 1; i < DATA_BLOCK_COUNT; i++)
+	{
+		run = blockUsed[i] ? 0 : run + 1;
+		if(run == size)
+			return i - size + 1;
+	}
+	return -1;
+}
+
+void markBlocks(int start, int size, bool used)
+{
+	for(int i = start; i < start + size; i++)
+		blockUsed[i] = used;
+}
+
+int freeBlockCount()
+{
+	int count = 0;
+
+	for(int i = 1; i <= DATA_BLOCK_COUNT; i++)
+		count += !blockUsed[i];
+	return count;
+}
+
+//Random live file, or -1 if there are none
+int randomFile()
+{
+	int files[INODE_COUNT];
+	int count = 0;
+
+	for(int i = 0; i < INODE_COUNT; i++)
+	{
+		if(nodes[i].used && !nodes[i].dir)
+			files[count++] = i;
+	}
+	return count ? files[randomBelow(count)] : -1;
+}
+
+void nodePath(int idx, char *out)
+{
+	if(ROOT_DIR == idx)
+	{
+		strcpy(out, "/");
+		return;
+	}
+
+	char parentPath[256];
+	nodePath(nodes[idx].parent, parentPath);
+	sprintf(out, "%s%s%s", parentPath, (ROOT_DIR == nodes[idx].parent) ? "" : "/", nodes[idx].name);
+}
+
+//Create a node in the model. Returns its index, or -1 if it does not fit.
+int addNode(int parent, bool dir, int size)
+{
+	int idx = firstFreeNode();
+	if(-1 == idx)
+		return -1;
+
+	int start = 0;
+	if(!dir)
+	{
+		start = firstFit(size);
+		if(-1 == start)
+			return -1;
+		markBlocks(start, size, true);
+	}
+
+	GenNode *node = &nodes[idx];
+	memset(node, 0, sizeof(GenNode));
+	node->used = true;
+	node->dir = dir;
+	node->parent = parent;
+	node->start = start;
+	node->size = dir ? 0 : size;
+
+	//files get base 36 names so a long run does not exhaust 5 characters
+	if(dir)
+		snprintf(node->name, sizeof(node->name), "d%d", dirCount);
+	else
+	{
+		static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+		int n = fileCounter++;
+		node->name[0] = 'f';
+		for(int i = 4; i >= 1; i--, n /= 36)
+			node->name[i] = digits[n % 36];
+	}
+
+	return idx;
+}
+
+void removeNode(int idx)
+{
+	if(!nodes[idx].dir)
+		markBlocks(nodes[idx].start, nodes[idx].size, false);
+	memset(&nodes[idx], 0, sizeof(GenNode));
+}
+
+//Directory tree of the given depth and fanout, breadth first
+int buildTree(int depth, int fanout)
+{
+	dirList[dirCount++] = ROOT_DIR;
+
+	int levelStart = 0;
+	for(int level = 0; level < depth; level++)
+	{
+		int levelEnd = dirCount;
+		for(int p = levelStart; p < levelEnd; p++)
+		{
+			for(int k = 0; k < fanout; k++)
+			{
+				if(dirCount > MAX_DIRS)
+					return -1;
+				dirList[dirCount] = addNode(dirList[p], true, 0);
+				dirCount++;
+			}
+		}
+		levelStart = levelEnd;
+	}
+	return 0;
+}
+
+//Fill the disk with files until fill of the data blocks are in use
+void prefill(double fill)
+{
+	int target = (int) (fill * DATA_BLOCK_COUNT);
+
+	while(DATA_BLOCK_COUNT - freeBlockCount() < target)
+	{
+		int size = randomSize();
+		int room = target - (DATA_BLOCK_COUNT - freeBlockCount());
+		if(size > room)
+			size = room;
+
+		if(-1 == addNode(dirList[randomBelow(dirCount)], false, size))
+			break;
+	}
+}
+
+int writeImage(char *diskName)
+{
+	static Superblock superBlock;
+	static char block[DATA_BLOCK_SIZE];
+
+	memset(&superBlock, 0, sizeof(superBlock));
+	superBlock.free_block_list[0] |= 1 << 7;
+
+	for(int i = 1; i <= DATA_BLOCK_COUNT; i++)
+	{
+		if(blockUsed[i])
+			superBlock.free_block_list[i/8] |= (1 << (7 - (i%8)));
+	}
+
+	for(int i = 0; i < INODE_COUNT; i++)
+	{
+		if(!nodes[i].used)
+			continue;
+
+		Inode *inode = &superBlock.inode[i];
+		strncpy(inode->name, nodes[i].name, 5);
+		inode->used_size = 0x80 | nodes[i].size;
+		inode->start_block = nodes[i].start;
+		inode->dir_parent = (nodes[i].dir ? 0x80 : 0) | nodes[i].parent;
+	}
+
+	FILE *disk = fopen(diskName, "wb");
+	if(NULL == disk)
+	{
+		perror("Error in opening the disk image");
+		return -1;
+	}
+
+	fwrite(&superBlock, sizeof(superBlock), 1, disk);
+
+	//prefilled files get recognisable contents, free blocks are zero
+	for(int i = 1; i <= DATA_BLOCK_COUNT; i++)
+	{
+		memset(block, 0, sizeof(block));
+		if(blockUsed[i])
+		{
+			for(int j = 0; j < DATA_BLOCK_SIZE; j++)
+				block[j] = 'a' + (i + j) % 26;
+		}
+		fwrite(block, sizeof(block), 1, disk);
+	}
+
+	if(0 != fclose(disk))
+	{
+		perror("Error in writing the disk image");
+		return -1;
+	}
+	return 0;
+}
+
+bool emitCreate(FILE *out)
+{
+	char path[256];
+	int idx = addNode(dirList[randomBelow(dirCount)], false, randomSize());
+	if(-1 == idx)
+		return false;
+
+	nodePath(idx, path);
+	fprintf(out, "C %s %d\n", path, nodes[idx].size);
+	return true;
+}
+
+bool emitDelete(FILE *out)
+{
+	char path[256];
+	int idx = randomFile();
+	if(-1 == idx)
+		return false;
+
+	nodePath(idx, path);
+	fprintf(out, "D %s\n", path);
+	removeNode(idx);
+	return true;
+}
+
+bool emitResize(FILE *out)
+{
+	char path[256];
+	int idx = randomFile();
+	if(-1 == idx)
+		return false;
+
+	GenNode *node = &nodes[idx];
+	int newSize = randomSize();
+
+	if(newSize > node->size)
+	{
+		bool inPlace = node->start + newSize - 1 <= DATA_BLOCK_COUNT;
+		for(int i = node->start + node->size; inPlace && i < node->start + newSize; i++)
+			inPlace = !blockUsed[i];
+
+		if(inPlace)
+			markBlocks(node->start + node->size, newSize - node->size, true);
+		else
+		{
+			int start = relocateTarget(newSize);
+			if(-1 == start)
+				return false;
+			markBlocks(node->start, node->size, false);
+			markBlocks(start, newSize, true);
+			node->start = start;
+		}
+	}
+	else if(newSize < node->size)
+		markBlocks(node->start + newSize, node->size - newSize, false);
+
+	nodePath(idx, path);
+	fprintf(out, "E %s %d\n", path, newSize);
+	node->size = newSize;
+	return true;
+}
+
+bool emitBlockOp(FILE *out, char op)
+{
+	char path[256];
+	int idx = randomFile();
+	if(-1 == idx)
+		return false;
+
+	nodePath(idx, path);
+	fprintf(out, "%c %s %d\n", op, path, randomBelow(nodes[idx].size));
+	return true;
+}
+
+void emitBuffer(FILE *out)
+{
+	int len = 1 + randomBelow(MAX_BUFFER_LEN);
+
+	fputs("B ", out);
+	for(int i = 0; i < len; i++)
+		fputc('a' + randomBelow(26), out);
+	fputc('\n', out);
+}
+
+//Compact the model the way fs_defrag does, in order of start block
+void emitDefrag(FILE *out)
+{
+	int next = 1;
+
+	for(int block = 1; block <= DATA_BLOCK_COUNT; block++)
+	{
+		for(int i = 0; i < INODE_COUNT; i++)
+		{
+			if(!nodes[i].used || nodes[i].dir || nodes[i].start != block)
+				continue;
+			markBlocks(nodes[i].start, nodes[i].size, false);
+			nodes[i].start = next;
+			markBlocks(next, nodes[i].size, true);
+			next += nodes[i].size;
+		}
+	}
+
+	fputs("O\n", out);
+}
+
+void emitCd(FILE *out)
+{
+	char path[256];
+
+	nodePath(dirList[randomBelow(dirCount)], path);
+	fprintf(out, "Y %s\n", path);
+}
+
+//One command from the mix. Falls back to another operation when the drawn
+//one has nothing to act on (no files, disk full).
+void emitCommand(FILE *out, int totalWeight)
+{
+	for(int attempt = 0; attempt < 16; attempt++)
+	{
+		int pick = randomBelow(totalWeight);
+		int op = 0;
+
+		while(pick >= opWeights[op])
+			pick -= opWeights[op++];
+
+		switch(opLetters[op])
+		{
+			case 'C':
+				if(emitCreate(out))
+					return;
+				break;
+			case 'D':
+				if(emitDelete(out))
+					return;
+				break;
+			case 'R':
+			case 'W':
+				if(emitBlockOp(out, opLetters[op]))
+					return;
+				break;
+			case 'B':
+				emitBuffer(out);
+				return;
+			case 'E':
+				if(emitResize(out))
+					return;
+				break;
+			case 'L':
+				fputs("L\n", out);
+				return;
+			case 'O':
+				emitDefrag(out);
+				return;
+			case 'Y':
+				emitCd(out);
+				return;
+		}
+	}
+
+	fputs("L\n", out);
+}
+
+//Parse an operation mix such as "C30,D15,R20". Letters not listed get 0.
+int parseMix(char *mix)
+{
+	memset(opWeights, 0, sizeof(opWeights));
+
+	for(char *item = strtok(mix, ","); NULL != item; item = strtok(NULL, ","))
+	{
+		char *letter = strchr(opLetters, item[0]);
+		char *end;
+		long weight = strtol(item + 1, &end, 10);
+
+		if('\0' == item[0] || NULL == letter || '\0' != *end || end == item + 1 || weight < 0)
+			return -1;
+		opWeights[letter - opLetters] = (int) weight;
+	}
+	return 0;
+}
+
+//Parse a size model: fixed:N, uniform:MIN:MAX or geom:MEAN
+int parseSizes(char *spec)
+{
+	if(1 == sscanf(spec, "fixed:%d", &sizeA))
+		sizeModel = SIZE_FIXED;
+	else if(2 == sscanf(spec, "uniform:%d:%d", &sizeA, &sizeB) && sizeA <= sizeB)
+		sizeModel = SIZE_UNIFORM;
+	else if(1 == sscanf(spec, "geom:%d", &sizeA))
+		sizeModel = SIZE_GEOMETRIC;
+	else
+		return -1;
+
+	return (sizeA >= 1 && sizeA < DATA_BLOCK_COUNT) ? 0 : -1;
+}
+
+void usage(char *prog)
+{
+	fprintf(stderr,"Usage: %s [-s seed] [-n commands] [-m mix] [-S sizes] [-d depth] [-f fanout]\n"
+			"          [-c churn] [-p prefill] [-D disk_name] [-o script]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t seed = 1;
+	long commands = 1000;
+	int depth = 2;
+	int fanout = 3;
+	double churn = 0.0;
+	double fill = 0.5;
+	char *diskName = "wldisk";
+	char *scriptName = NULL;
+	int opt;
+
+	while(-1 != (opt = getopt(argc, argv, "s:n:m:S:d:f:c:p:D:o:")))
+	{
+		switch(opt)
+		{
+			case 's':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'n':
+				commands = atol(optarg);
+				break;
+			case 'm':
+				if(0 != parseMix(optarg))
+				{
+					fprintf(stderr,"Error: Invalid operation mix %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'S':
+				if(0 != parseSizes(optarg))
+				{
+					fprintf(stderr,"Error: Invalid size model %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'd':
+				depth = atoi(optarg);
+				break;
+			case 'f':
+				fanout = atoi(optarg);
+				break;
+			case 'c':
+				churn = atof(optarg);
+				break;
+			case 'p':
+				fill = atof(optarg);
+				break;
+			case 'D':
+				diskName = optarg;
+				break;
+			case 'o':
+				scriptName = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if(optind != argc)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	int totalWeight = 0;
+	for(size_t i = 0; i < sizeof(opWeights) / sizeof(opWeights[0]); i++)
+		totalWeight += opWeights[i];
+
+	if(0 == totalWeight || commands < 0 || depth < 0 || fanout < 1 || churn < 0 || churn > 1 || fill < 0 || fill > 1)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	rngState = seed;
+
+	if(0 != buildTree(depth, fanout))
+	{
+		fprintf(stderr,"Error: A tree of depth %d and fanout %d needs more than %d directories\n", depth, fanout, MAX_DIRS);
+		return 1;
+	}
+
+	prefill(fill);
+
+	if(0 != writeImage(diskName))
+		return 1;
+
+	FILE *out = stdout;
+	if(NULL != scriptName && NULL == (out = fopen(scriptName, "w")))
+	{
+		perror("Error in opening the script file");
+		return 1;
+	}
+
+	fprintf(out, "M %s\n", diskName);
+
+	for(long i = 0; i < commands; i++)
+	{
+		//churn replaces a live file with a new one of a fresh size
+		if(churn > 0 && randomUnit() < churn && emitDelete(out))
+		{
+			emitCreate(out);
+			continue;
+		}
+
+		emitCommand(out, totalWeight);
+	}
+
+	if(out != stdout && 0 != fclose(out))
+	{
+		perror("Error in writing the script file");
+		return 1;
+	}
+
+	return 0;
+}